@@ -13,6 +13,98 @@
  *  Blocking operations will lead the current thread to sleep on a wait queue, there are 2 wait queues defined for each minor number:
  *   - one used to keep threads that are waiting to acquire the lock
  *   - one keeps thread that are waiting for read/write operations
+ *
+ *  A device file can also be switched in fan-out mode: reads are no more destructive, each session reads through its
+ *  own cursor and a page is released only when all the active cursors of the flow have moved past it.
+ *  Sessions can join a named consumer group: the members of a group share a single read position and each read returns
+ *  only whole records (the data of a single write), so that records are spread across the readers without being split.
+ *
+ *  Every byte of a flow has a 64 bit logical offset. A flow can keep a retention window of already consumed data, that a 
+ *  session can read again moving to a given offset with lseek (the offset of the last write is given by GET_WRITE_OFFSET).
+ *
+ *  In overwrite mode (flight recorder) a write to a full flow always succeeds, dropping the oldest records: the amount
+ *  of data lost by a reader is returned by GET_MISSED and the totals are exported as module parameters.
+ *
+ *  A flow can be mirrored to the same flow of other minors (LINK_MINOR): each accepted write is appended to all of them 
+ *  by the driver itself. A minor cannot be both a source and a destination of mirrors, so that links never form cycles.
+ *
+ *  A minor can lead a shard group (SET_SHARDS): writes issued on the leader are spread over the member minors, by CPU or
+ *  by a key chosen by the session, and reads on the leader drain all the members, so that one logical stream is not 
+ *  bound to the locks of a single minor.
+ *
+ *  With MULTI_READ a single call drains a set of flows of different minors, waiting until any of them has data, and
+ *  returns the data tagged by source.
+ *
+ *  Writes can be rate limited, in bytes and operations per second, both per session and per minor (SET_RATE_LIMIT).
+ *  A write over the limit waits for the needed tokens if the session is blocking, otherwise it fails with -EAGAIN.
+ *
+ *  The lock of a flow is granted in FIFO order: a session that has to wait for it queues behind the others, and a new
+ *  operation does not take the lock while someone is queued. GET_WAIT_STATS returns the queueing times of the session.
+ *
+ *  A minor can age its low priority data (SET_AGING): the records that stayed in the low flow longer than the given
+ *  number of milliseconds are moved, whole, to the tail of the high flow. The promotion is done by the high priority
+ *  reads and by a periodic work, so that the low priority data has a bounded delivery time even if only the high flow
+ *  is drained.
+ *
+ *  Each flow can have a time to live (SET_TTL): records written more than the given milliseconds ago are discarded
+ *  unread. Expiry is checked by reads and writes on the flow, and by a background sweep every EXPIRY_SWEEP_MSECS.
+ *
+ *  Timeouts are kept in nanoseconds and the sleeps use hrtimers, so blocking operations are not rounded to jiffies.
+ *  SET_BLOCKING still takes jiffies, SET_TIMEOUT_NS sets the default of the session in nanoseconds and
+ *  SET_NEXT_TIMEOUT_NS overrides it for the next operation only. The timeout bounds the whole operation: the lock
+ *  and data waits of a read or a write share one deadline, each of them only gets the time left.
+ *
+ *  Low latency sessions can busy poll before sleeping (SET_SPIN_USECS): a blocked operation spins watching the flow
+ *  for up to the given microseconds, and only then goes to the wait queue.
+ *
+ *  A reader that parks on the empty high flow leaves its buffer to the writers: the next high priority write that fits
+ *  it is copied there directly, without going through the pages of the flow. This is done only when nobody else could
+ *  see the data in the flow (no fan-out, consumer groups or retention window).
+ *
+ *  The deferred writes of the low flow are also kept in a per minor list, in submission order. A reader of the low
+ *  flow appends the pending ones by itself before reading, instead of waiting for the work queue to run them; the
+ *  work of a write that was already appended only releases its memory.
+ *
+ *  Deferred writes get a per minor sequence number and are appended in that order, whatever CPU runs their work: a
+ *  work first appends the writes submitted before its own. A session can relax the ordering (SET_ORDERING), then its
+ *  deferred writes are appended as soon as their work runs, and GET_WRITE_OFFSET is only a hint for them.
+ *
+ *  fsync, flush and SYNC_WRITES are barriers for the deferred writes: they return once the pending writes of the
+ *  session (or, for SYNC_WRITES with a non zero parameter, of the whole minor) are in the stream. The barrier appends
+ *  them by itself, so it only waits for the lock of the low flow, within the timeout of the session.
+ *
+ *  OPEN_COMPLETIONS returns a companion fd of the session: each deferred write submitted afterwards posts there a
+ *  completion_entry (sequence number, bytes appended, status) when it lands in the stream. The fd can be read, in
+ *  whole entries, and polled.
+ *
+ *  The deferred writes of a minor can be batched (SET_BATCH, or the batch_usecs and batch_bytes parameters): instead of
+ *  a work per write, the writes wait up to batch_usecs, or until batch_bytes are pending, and are appended together by
+ *  one delayed work.
+ *
+ *  A minor can also get a dedicated thread for its deferred writes (SET_WORKER), with its own scheduling policy, nice
+ *  level and CPU, so that their latency does not depend on the other users of the system work queue. While the thread
+ *  runs it appends all the deferred writes of the minor, batching included.
+ *
+ *  SET_OPENCLOSE with CLOSE_DRAIN disables a minor once its pending deferred writes are appended, with CLOSE_CANCEL
+ *  they are dropped instead: their space is given back and their completions report -ECANCELED. Either way the ioctl
+ *  returns the bytes handled and a disabled minor takes no new writes, so it can be reconfigured, or the module
+ *  unloaded, without leaving work behind.
+ *
+ *  QUIESCE prepares the whole device for an upgrade: no minor accepts writes any more (they fail with -EAGAIN), the
+ *  deferred writes are appended, and the call waits up to the given milliseconds for the readers to empty the flows.
+ *  The bytes left in each flow are returned in total and per minor in high_residual_bytes and low_residual_bytes.
+ *
+ *  EXPORT_IMAGE copies to user space a binary image (see image_header in structs.h) of the data held by all the minors,
+ *  record by record, together with their settings. After the module is loaded again, IMPORT_IMAGE appends the data of
+ *  the image to the flows and restores the settings, so an upgrade done between QUIESCE and a reload loses no data.
+ *
+ *  A flow can have a spill file (SET_SPILL): a write that does not fit the memory of the flow is appended to the file
+ *  instead of failing with -ENOSPC, and so are the writes after it while the file holds data. As the readers make room
+ *  a work reads the spilled records back, in order, into the flow, with the next ones read ahead. Memory stays bounded
+ *  by MAX_PAGES while the stream absorbs long stalls of the consumers. No image is exported while a spill file holds data.
+ *  A spilled low priority write keeps its sequence number, and its completion is posted once it is read back.
+ *  Spill files need kernel_read/kernel_write with a position and vfs_fadvise, so Linux 4.19 or later; on older kernels
+ *  SET_SPILL fails with -EOPNOTSUPP.
  */
 
 
@@ -33,6 +125,13 @@
 #include <asm/current.h> 
 #include <linux/wait.h> 
 #include <linux/string.h>
+#include <linux/anon_inodes.h>
+#include <linux/poll.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/fadvise.h>
+#include <linux/capability.h>
 
 #include "structs/structs.h"
 
@@ -50,14 +149,98 @@ static int dev_release(struct inode *, struct file *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
 static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off);
 static long dev_ioctl(struct file *filp, unsigned int command, unsigned long param);
+static loff_t dev_llseek(struct file *filp, loff_t offset, int whence);
 
 
 /* Helper function prototypes */
 void do_wq_write(unsigned long data);
-int do_sleep_wqe(long op_timeout, int minor, int priority, int value, int event);
+int do_sleep_wqe(u64 op_timeout, int minor, int priority, long long value, int event);
 static ssize_t write_data(size_t len, int minor, char* buffer, int priority); 
-int try_get_lock(io_sess_info* sess_info, int minor, const char* operation);
-int try_wait_for_data(io_sess_info* sess_info, int minor, int value, int event);
+int try_get_lock(io_sess_info* sess_info, op_deadline *op, int minor, const char* operation);
+static int try_get_flow_lock(io_sess_info* sess_info, op_deadline *op, int minor, int priority, const char* operation);
+int try_wait_for_data(io_sess_info* sess_info, op_deadline *op, int minor, long long value, int event);
+static void read_stream_data(object_state *the_object, int priority, u64 offset, char *buffer, int len);
+static void consume_stream_data(object_state *the_object, int priority, int len);
+static void give_back_free_bytes(object_state *the_object, int priority, int len);
+static void reclaim_fanout_data(object_state *the_object, int priority);
+static read_cursor* session_cursor(object_state *the_object, io_sess_info *sess_info);
+static int readable_bytes(object_state *the_object, int priority, read_cursor *cursor);
+static int set_fanout_mode(int minor, unsigned long param);
+static void add_record(object_state *the_object, int priority);
+static int record_bytes(object_state *the_object, int priority, u64 start, int len);
+static int join_group(int minor, io_sess_info *sess_info, const char __user *name);
+static void leave_group(int minor, io_sess_info *sess_info);
+static void trim_stream_data(object_state *the_object, int priority);
+static int replay_pending(object_state *the_object, io_sess_info *sess_info, read_cursor *cursor);
+static void drop_stream_data(object_state *the_object, int priority, int len);
+static int make_room(object_state *the_object, int priority, size_t len);
+static int append_to_flow(object_state *the_object, int priority, char *buffer, size_t len);
+static void wake_up_readers(object_state *the_object, int priority);
+static void mirror_write(object_state *the_object, int priority, char *buffer, size_t len);
+static int link_minor(int minor, int priority, unsigned long param);
+static int unlink_minor(int minor, int priority, unsigned long param);
+static int select_shard(int minor, io_sess_info *sess_info);
+static int set_shard_group(int minor, const void __user *param);
+static int shard_has_data(int minor, int priority);
+static ssize_t shard_read(int minor, io_sess_info *sess_info, op_deadline *op, char *buff, size_t len);
+static int take_stream_data(object_state *the_object, int priority, int whole_records, char *buffer, int len);
+static int multi_has_data(multi_read_info *info);
+static long multi_read(io_sess_info *sess_info, const void __user *param);
+static void init_bucket(token_bucket *bucket, unsigned long bytes_rate, unsigned long ops_rate);
+static void refill_bucket(token_bucket *bucket, ktime_t now);
+static u64 bucket_wait(token_bucket *bucket, size_t len);
+static void bucket_take(token_bucket *bucket, size_t len);
+static int throttle_write(io_sess_info *sess_info, op_deadline *op, int minor, size_t len);
+static int set_rate_limit(int minor, io_sess_info *sess_info, const void __user *param);
+static int fair_lock_ready(object_state *the_object, int priority);
+static void wake_up_flow(object_state *the_object, int priority);
+static int get_wait_stats(io_sess_info *sess_info, void __user *param);
+static int promote_aged_data(object_state *the_object);
+static void do_aging_work(struct work_struct *work);
+static void set_aging(int minor, unsigned long msecs);
+static int expire_stream_data(object_state *the_object, int priority);
+static void do_expiry_work(struct work_struct *work);
+static void start_operation(io_sess_info *sess_info, op_deadline *op);
+static void set_deadline(op_deadline *op, u64 timeout);
+static u64 remaining_timeout(op_deadline *op);
+static int wait_condition(int minor, int priority, long long value, int event);
+static int spin_wait(io_sess_info *sess_info, op_deadline *op, int minor, int priority, long long value, int event);
+static int handoff_allowed(object_state *the_object);
+static int handoff_write(object_state *the_object, char *buffer, size_t len);
+static void release_flow_pages(object_state *the_object, int priority);
+static void run_deferred_write(object_state *the_object, packed_data_wq *the_wq);
+static void cancel_deferred_write(object_state *the_object, packed_data_wq *the_wq);
+static void finish_deferred_write(object_state *the_object, packed_data_wq *the_wq, int ret);
+static int drain_deferred_writes(object_state *the_object);
+static int sync_deferred_writes(int minor, io_sess_info *sess_info, op_deadline *op, int whole_minor, int nowait);
+static int dev_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+static int dev_flush(struct file *filp, fl_owner_t id);
+static void free_completion_ring(struct kref *refs);
+static void post_completion(completion_ring *ring, u64 seq, u32 len, s32 status);
+static int open_completions(int minor, io_sess_info *sess_info);
+static ssize_t cq_read(struct file *filp, char __user *buff, size_t len, loff_t *off);
+static __poll_t cq_poll(struct file *filp, poll_table *wait);
+static int cq_release(struct inode *inode, struct file *filp);
+static void do_batch_work(struct work_struct *work);
+static void arm_batch(object_state *the_object, int minor);
+static int set_batch(int minor, const void __user *param);
+static int deferred_worker(void *data);
+static int set_worker(int minor, const void __user *param);
+static void stop_worker(object_state *the_object);
+static long set_open_close(int minor, unsigned long param);
+static unsigned long residual_bytes(int *busy_minors);
+static long quiesce_device(void __user *param);
+static int export_flow(object_state *the_object, int priority, image_minor *entry, char *buffer);
+static int export_minor(int minor, char *chunk);
+static long export_image(void __user *param);
+static int import_minor(image_minor *entry, char *chunk);
+static long import_image(void __user *param);
+static int spill_needed(object_state *the_object, int priority, size_t len);
+static int spill_write(object_state *the_object, int priority, io_sess_info *sess_info, char *buffer, size_t len);
+static void ack_spilled_write(object_state *the_object, spill_ack *ack, int len);
+static int refill_from_spill(object_state *the_object, int priority);
+static void do_spill_work(struct work_struct *work);
+static int set_spill(int minor, int priority, const void __user *param);
 
 /* Defines for the device driver */
 //#define SINGLE_INSTANCE               // just one session at a time across all I/O node 
@@ -77,6 +260,11 @@ int try_wait_for_data(io_sess_info* sess_info, int minor, int value, int event);
 static DEFINE_MUTEX(device_state);
 #endif
 
+static DEFINE_MUTEX(links_lock);    // serializes changes to the mirror links, taken before the flow locks
+static DEFINE_MUTEX(shards_lock);   // serializes changes to the shard groups
+static DECLARE_WAIT_QUEUE_HEAD(multi_wq_head);  // threads blocked in MULTI_READ, woken by every append
+static DECLARE_DELAYED_WORK(expiry_work, do_expiry_work);  // periodic sweep of the expired records
+
 
 #define MINORS 128  // the numbers of minors that the driver can handle are 128
 object_state objects[MINORS]; // as many structs as the number of minors that can be managed
@@ -88,21 +276,67 @@ static int Major;            /* Major number assigned to broadcast device driver
  * */
 #define OBJECT_MAX_SIZE  (4096) //just one page for the amount of data that each flow can handle for each of the minors
 #define MAX_PAGES 5     // number of pages for each device file
+#define MAX_RETAIN_PAGES 5  // max number of pages of consumed data that each flow can keep for replays
+#define MAX_MULTI_READ (16*OBJECT_MAX_SIZE) // max amount of data returned by a single MULTI_READ
+#define EXPIRY_SWEEP_MSECS 1000  // period of the background sweep of the expired records
+#define QUIESCE_POLL_MSECS 10    // period of the checks of a QUIESCE waiting for the readers
+#define FLOW_MAX_BYTES (OBJECT_MAX_SIZE*MAX_PAGES)  // max amount of data held by a flow
+#define SPILL_READAHEAD (4*OBJECT_MAX_SIZE)  // spilled data read ahead after each refill
+#define IMAGE_CHUNK_MAX (sizeof(image_minor) + NR_FLOWS*FLOW_MAX_BYTES*(1 + sizeof(unsigned int)))   // max size of the image of a minor
 
 
-/* Redefinition of these macros to allow threads to sleep in WQ_EXCLUSIVE mode */ 
-#define __wait_event_interruptible_timeout_exclusive(wq_head, condition, timeout)		\
-	___wait_event(wq_head, ___wait_cond_timeout(condition),			\
-		      TASK_INTERRUPTIBLE, 1, timeout,				\
-		      __ret = schedule_timeout(__ret))
+/* Redefinition of the hrtimeout wait to allow threads to sleep in WQ_EXCLUSIVE mode, the timeout is a ktime_t.
+ * The sleeper API it needs came in 5.4 and its init call was replaced in 6.13, older kernels wait in jiffies */ 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define init_exclusive_sleeper(t)	hrtimer_setup_sleeper_on_stack(t, CLOCK_MONOTONIC, HRTIMER_MODE_REL)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+#define init_exclusive_sleeper(t)	hrtimer_init_sleeper_on_stack(t, CLOCK_MONOTONIC, HRTIMER_MODE_REL)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+#define __wait_event_interruptible_hrtimeout_exclusive(wq_head, condition, timeout)		\
+({										\
+	int __ret = 0;								\
+	struct hrtimer_sleeper __t;						\
+										\
+	init_exclusive_sleeper(&__t);						\
+	if ((timeout) != KTIME_MAX) {						\
+		hrtimer_set_expires_range_ns(&__t.timer, timeout,		\
+					current->timer_slack_ns);		\
+		hrtimer_sleeper_start_expires(&__t, HRTIMER_MODE_REL);		\
+	}									\
+										\
+	__ret = ___wait_event(wq_head, condition, TASK_INTERRUPTIBLE, 1, 0,	\
+		if (!__t.task) {						\
+			__ret = -ETIME;						\
+			break;							\
+		}								\
+		schedule());							\
+										\
+	hrtimer_cancel(&__t.timer);						\
+	destroy_hrtimer_on_stack(&__t.timer);					\
+	__ret;									\
+})
+#else
+#define __wait_event_interruptible_hrtimeout_exclusive(wq_head, condition, timeout)		\
+({										\
+	long __tmo = (ktime_to_ns(timeout) == KTIME_MAX) ? MAX_SCHEDULE_TIMEOUT :	\
+		(long)nsecs_to_jiffies(ktime_to_ns(timeout)) + 1;		\
+										\
+	__tmo = ___wait_event(wq_head, ___wait_cond_timeout(condition),		\
+		TASK_INTERRUPTIBLE, 1, __tmo,					\
+		__ret = schedule_timeout(__ret));				\
+	(__tmo == 0) ? -ETIME : ((__tmo < 0) ? (int)__tmo : 0);			\
+})
+#endif
 
 
-#define wait_event_interruptible_timeout_exclusive(wq_head, condition, timeout)		\
+#define wait_event_interruptible_hrtimeout_exclusive(wq_head, condition, timeout)	\
 ({										\
-	long __ret = timeout;							\
+	int __ret = 0;								\
 	might_sleep();								\
-	if (!___wait_cond_timeout(condition))					\
-		__ret = __wait_event_interruptible_timeout_exclusive(wq_head,		\
+	if (!(condition))							\
+		__ret = __wait_event_interruptible_hrtimeout_exclusive(wq_head,	\
 						condition, timeout);		\
 	__ret;									\
 })
@@ -126,6 +360,87 @@ module_param_array(high_wait_data, ulong, NULL, 0440);
 unsigned long low_wait_data[MINORS];
 module_param_array(low_wait_data, ulong, NULL, 0440);
 
+unsigned long high_dropped_bytes[MINORS];
+module_param_array(high_dropped_bytes, ulong, NULL, 0440);
+
+unsigned long low_dropped_bytes[MINORS];
+module_param_array(low_dropped_bytes, ulong, NULL, 0440);
+
+unsigned long throttled_bytes[MINORS];
+module_param_array(throttled_bytes, ulong, NULL, 0440);
+
+unsigned long throttled_usecs[MINORS];
+module_param_array(throttled_usecs, ulong, NULL, 0440);
+
+unsigned long promoted_bytes[MINORS];
+module_param_array(promoted_bytes, ulong, NULL, 0440);
+
+unsigned long high_expired_bytes[MINORS];
+module_param_array(high_expired_bytes, ulong, NULL, 0440);
+
+unsigned long low_expired_bytes[MINORS];
+module_param_array(low_expired_bytes, ulong, NULL, 0440);
+
+unsigned long spin_success[MINORS];
+module_param_array(spin_success, ulong, NULL, 0440);
+
+unsigned long spin_fallback[MINORS];
+module_param_array(spin_fallback, ulong, NULL, 0440);
+
+unsigned long handoff_bytes[MINORS];
+module_param_array(handoff_bytes, ulong, NULL, 0440);
+
+unsigned long low_inline_bytes[MINORS];
+module_param_array(low_inline_bytes, ulong, NULL, 0440);
+
+unsigned long long low_submit_seq[MINORS];
+module_param_array(low_submit_seq, ullong, NULL, 0440);
+
+unsigned long long low_applied_seq[MINORS];
+module_param_array(low_applied_seq, ullong, NULL, 0440);
+
+unsigned long completions_lost[MINORS];
+module_param_array(completions_lost, ulong, NULL, 0440);
+
+unsigned long batch_usecs[MINORS];
+module_param_array(batch_usecs, ulong, NULL, 0660);
+
+unsigned long batch_bytes[MINORS];
+module_param_array(batch_bytes, ulong, NULL, 0660);
+
+unsigned long low_batches[MINORS];
+module_param_array(low_batches, ulong, NULL, 0440);
+
+unsigned long low_batched_bytes[MINORS];
+module_param_array(low_batched_bytes, ulong, NULL, 0440);
+
+unsigned long low_batch_max[MINORS];
+module_param_array(low_batch_max, ulong, NULL, 0440);
+
+unsigned long low_worker_bytes[MINORS];
+module_param_array(low_worker_bytes, ulong, NULL, 0440);
+
+unsigned long low_cancelled_bytes[MINORS];
+module_param_array(low_cancelled_bytes, ulong, NULL, 0440);
+
+int quiesced;   // set by QUIESCE, no minor accepts writes
+module_param(quiesced, int, 0440);
+
+unsigned long high_residual_bytes[MINORS];
+module_param_array(high_residual_bytes, ulong, NULL, 0440);
+
+unsigned long low_residual_bytes[MINORS];
+module_param_array(low_residual_bytes, ulong, NULL, 0440);
+
+unsigned long import_dropped_bytes[MINORS];
+module_param_array(import_dropped_bytes, ulong, NULL, 0440);
+
+unsigned long spilled_bytes[MINORS];
+module_param_array(spilled_bytes, ulong, NULL, 0440);
+
+unsigned long spill_refilled_bytes[MINORS];
+module_param_array(spill_refilled_bytes, ulong, NULL, 0440);
+
 
 /* The actual driver */
 
@@ -162,8 +477,30 @@ static int dev_open(struct inode *inode, struct file *file) {
 #endif
         sess_info = (io_sess_info* )kzalloc(sizeof(io_sess_info), GFP_ATOMIC);
         if(sess_info != NULL){
+            int j;
             sess_info->priority = 1;
-            sess_info->timeout = 0;
+            sess_info->timeout_ns = 0;
+            sess_info->next_timeout_ns = NO_NEXT_TIMEOUT;
+            sess_info->spin_usecs = 0;
+            sess_info->relaxed_order = 0;
+            sess_info->completions = NULL;
+            for(j=0;j<NR_FLOWS;j++){
+                sess_info->cursors[j].active = 0;
+                sess_info->cursors[j].missed = 0;
+                INIT_LIST_HEAD(&(sess_info->cursors[j].node));
+            }
+            sess_info->group = NULL;
+            sess_info->shard_key = SHARD_BY_CPU;
+            init_bucket(&(sess_info->write_limit), 0, 0);
+            sess_info->lock_waits = 0;
+            sess_info->lock_timeouts = 0;
+            sess_info->lock_wait_total = 0;
+            sess_info->lock_wait_max = 0;
+            sess_info->write_offset = 0;
+            for(j=0;j<NR_FLOWS;j++){
+                sess_info->replay_active[j] = 0;
+                sess_info->dropped_seen[j] = objects[minor].dropped_total[j];   // drops before the open are not reported
+            }
             file->private_data = sess_info;
         
             //device opened by a default nop
@@ -184,7 +521,24 @@ open_failure:
 
 static int dev_release(struct inode *inode, struct file *file) {
         int minor;
+        int j;
+        io_sess_info *sess_info;
         minor = get_minor(file);
+        sess_info = (io_sess_info *)(file->private_data);
+
+        leave_group(minor, sess_info);
+
+        /* Detach the cursors of the session, the pages that only this session was still holding can now be freed */
+        for(j=0;j<NR_FLOWS;j++){
+            mutex_lock(&(objects[minor].operation_synchronizer[j]));
+            if(sess_info->cursors[j].active){
+                list_del_init(&(sess_info->cursors[j].node));
+                sess_info->cursors[j].active = 0;
+                reclaim_fanout_data(objects + minor, j);
+            }
+            mutex_unlock(&(objects[minor].operation_synchronizer[j]));
+            wake_up_flow(objects + minor, j);
+        }
         
 #ifdef SINGLE_SESSION_OBJECT
         mutex_unlock(&(objects[minor].object_busy));
@@ -197,8 +551,11 @@ static int dev_release(struct inode *inode, struct file *file) {
 
 #ifdef DEBUG_INFO
         printk("%s: device file closed\n",MODNAME);
-        kfree(file->private_data);
 #endif
+        // the completion fd and the pending deferred writes keep their own references to the ring
+        if(sess_info->completions != NULL)
+            kref_put(&(sess_info->completions->refs), free_completion_ring);
+        kfree(file->private_data);
         return 0;
 }
 
@@ -210,9 +567,12 @@ static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t
         int minor = get_minor(filp);
         int tot_written;
         char* temp_buffer;
+        op_deadline op;
         
-        the_object = objects + minor;
         sess_info = (io_sess_info *)(filp->private_data); 
+        start_operation(sess_info, &op);
+        minor = select_shard(minor, sess_info);     // writes on a shard leader go to one of the members
+        the_object = objects + minor;
         
 #ifdef DEBUG_INFO
         printk("%s: somebody called a write on dev with [major,minor] number [%d,%d] to write %ld\n",MODNAME,get_major(filp),get_minor(filp), len);
@@ -227,36 +587,85 @@ static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t
         ret = copy_from_user(temp_buffer, buff, len);    // copy in an intermediate kernel buffer
         len = (len - ret);
 
+        /* Wait for the tokens before taking the lock, so that a throttled writer does not stall the others */
+        ret = throttle_write(sess_info, &op, minor, len);
+        if(ret < 0){
+            kfree((void*)temp_buffer);
+            return ret;
+        }
+
         
-        if(try_get_lock(sess_info, minor, "write") != 1){
+        if(try_get_lock(sess_info, &op, minor, "write") != 1){
             kfree((void*)temp_buffer);
             goto no_lock;
         }
+        expire_stream_data(the_object, sess_info->priority);
         
-        /* There is no space on the device, so try to wait for a given timeout */
-        if(the_object->total_free_bytes[sess_info->priority] == 0 && sess_info->timeout > 0){
+        /* There is no space on the device, so try to wait for a given timeout. In overwrite mode the write makes room by itself */
+        if(the_object->total_free_bytes[sess_info->priority] == 0 && op.timeout > 0 && !the_object->overwrite &&
+                the_object->spill_file[sess_info->priority] == NULL){
             mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority]));
+            wake_up_flow(the_object, sess_info->priority);
 #ifdef DEBUG_INFO
             printk("%s: write going to wait for lack of data\n", MODNAME);
 #endif
-            if(try_wait_for_data(sess_info, minor, 0, WAIT_WRITE) != 1){
+            if(try_wait_for_data(sess_info, &op, minor, 0, WAIT_WRITE) != 1){
                 kfree((void*)temp_buffer);
                 return -ENOSPC;
             } 
             // Try to get the lock again, if it fails it will exit
-            if(try_get_lock(sess_info, minor, "write") != 1){
+            if(try_get_lock(sess_info, &op, minor, "write") != 1){
                 kfree((void*)temp_buffer);
                 goto no_lock;
             }
+            expire_stream_data(the_object, sess_info->priority);
         }
 
         
         /* Got the lock, so from now on there is the write operation */
 
+        // a disabled minor takes no new data, its pending deferred writes were already drained or cancelled
+        if(enable_disable_array[minor]){
+            mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority]));
+            wake_up_flow(the_object, sess_info->priority);
+            kfree((void*)temp_buffer);
+            return -ENODEV;
+        }
+        if(READ_ONCE(quiesced)){
+            mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority]));
+            wake_up_flow(the_object, sess_info->priority);
+            kfree((void*)temp_buffer);
+            return -EAGAIN;
+        }
+
+        if(the_object->overwrite){
+            int dropped = make_room(the_object, sess_info->priority, len);
+            if(sess_info->priority)
+                high_dropped_bytes[minor] += dropped;
+            else
+                low_dropped_bytes[minor] += dropped;
+        }
+
+        /* With a spill file the data that does not fit the flow goes to the file, and so does everything written after it
+         * until the file is read back */
+        if(spill_needed(the_object, sess_info->priority, len)){
+            if(len > FLOW_MAX_BYTES)
+                len = FLOW_MAX_BYTES;   // a record must fit the flow once it is read back
+            sess_info->write_offset = (sess_info->priority ? the_object->stream_tail[1] : the_object->submit_tail) + 
+                the_object->spill_bytes[sess_info->priority];
+            tot_written = spill_write(the_object, sess_info->priority, sess_info, temp_buffer, len);
+            if(tot_written > 0)
+                mirror_write(the_object, sess_info->priority, temp_buffer, tot_written);
+            mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority]));
+            wake_up_flow(the_object, sess_info->priority);
+            kfree((void*)temp_buffer);
+            return tot_written;
+        }
+
         // Check again if the acutal copy can be performed
         if(the_object->total_free_bytes[sess_info->priority] == 0){
             mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority])); 
-            wake_up_interruptible(&(the_object->the_wq_head[sess_info->priority]));
+            wake_up_flow(the_object, sess_info->priority);
             kfree((void*)temp_buffer);
 #ifdef DEBUG_INFO
             printk("%s: device file is full \n", MODNAME);
@@ -271,11 +680,12 @@ static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t
         /* Low priority flow, the write work will be scheduled */       
         if (!sess_info->priority){  
             packed_data_wq *the_wq;
+            struct task_struct *worker;
             
             if (!try_module_get(THIS_MODULE)){
                 mutex_unlock(&(the_object->operation_synchronizer[0]));
                 
-                wake_up_interruptible(&(the_object->the_wq_head[0]));    // wakes up one thread in the wait_queue of threads that are waiting for the lock
+                wake_up_flow(the_object, 0);
                 kfree((void*)temp_buffer);
                 return -ENODEV;
             }
@@ -291,7 +701,7 @@ static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t
                 
                 mutex_unlock(&(the_object->operation_synchronizer[0])); 
                 
-                wake_up_interruptible(&(the_object->the_wq_head[0]));    // wakes up one thread in the wait_queue of threads that are waiting for the lock
+                wake_up_flow(the_object, 0);
                 kfree((void*)temp_buffer);
                 return -1;
             }
@@ -309,17 +719,45 @@ static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t
                 kfree((void*)temp_buffer);
                 
                 mutex_unlock(&(the_object->operation_synchronizer[0])); 
-                wake_up_interruptible(&(the_object->the_wq_head[0]));
+                wake_up_flow(the_object, 0);
                 return -ENOMEM;
             }
             the_wq->data = temp_buffer;
             the_wq->len = len; 
+            the_wq->done = 0;
+            the_wq->relaxed = sess_info->relaxed_order;
+            the_wq->seq = ++low_submit_seq[minor];
+            sess_info->last_seq = the_wq->seq;
+            the_wq->ring = READ_ONCE(sess_info->completions);
+            if(the_wq->ring != NULL)
+                kref_get(&(the_wq->ring->refs));
             the_object->total_free_bytes[0] -= len;   // decrement the total free bytes, work queue will never fail
+            list_add_tail(&(the_wq->node), &(the_object->deferred_writes));
+            the_object->deferred_bytes += len;
+
+            /* The data will land after all the deferred writes already submitted */
+            sess_info->write_offset = the_object->submit_tail;
+            the_object->submit_tail += len;
+
+            /* The dedicated thread of the minor, if any, appends the write. Otherwise with batching the write waits for 
+             * the batch work, and without it gets its own */
+            worker = the_object->worker;
+            the_wq->has_work = (worker == NULL && batch_usecs[minor] == 0);
+            if(worker != NULL)
+                get_task_struct(worker);
+            else if(!the_wq->has_work)
+                arm_batch(the_object, minor);
             mutex_unlock(&(the_object->operation_synchronizer[0]));
             
-            __INIT_WORK(&(the_wq->the_work), (void *)do_wq_write, (unsigned long)(&(the_wq->the_work))); 
-            schedule_work_on(0, &the_wq->the_work);  
-            wake_up_interruptible(&(the_object->the_wq_head[0]));
+            if(worker != NULL){
+                wake_up_process(worker);
+                put_task_struct(worker);
+            }
+            else if(the_wq->has_work){
+                __INIT_WORK(&(the_wq->the_work), (void *)do_wq_write, (unsigned long)(&(the_wq->the_work))); 
+                schedule_work(&the_wq->the_work);   // any CPU, the order is kept by the sequence numbers
+            }
+            wake_up_flow(the_object, 0);
             
 #ifdef DEBUG_INFO
             printk("%s: Work queue successfully scheduled\n", MODNAME);
@@ -328,18 +766,35 @@ static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t
         }
 
         /* High priority flow, the write is synchronously */
+
+        // a reader is parked on the empty flow, the data goes straight into its buffer
+        tot_written = handoff_write(the_object, temp_buffer, len);
+        if(tot_written > 0){
+            sess_info->write_offset = the_object->stream_tail[1] - tot_written;
+            mirror_write(the_object, 1, temp_buffer, tot_written);
+            mutex_unlock(&(the_object->operation_synchronizer[1]));
+            wake_up_flow(the_object, 1);
+            kfree((void*)temp_buffer);
+            return tot_written;
+        }
          
-        tot_written = write_data(len, minor, temp_buffer, sess_info->priority);
-        the_object->valid_bytes[1] += tot_written;
+        sess_info->write_offset = the_object->stream_tail[1];
+        tot_written = append_to_flow(the_object, 1, temp_buffer, len);
+        if(tot_written < 0){
+            mutex_unlock(&(the_object->operation_synchronizer[1]));
+            wake_up_flow(the_object, 1);
+            kfree((void*)temp_buffer);
+            return -ENOMEM;
+        }
         the_object->total_free_bytes[1] -= tot_written;
-        high_data_count[minor] += tot_written;
+        mirror_write(the_object, 1, temp_buffer, tot_written);
              
 #ifdef DEBUG_INFO
         printk("%s: Valid bytes are now: %d\n", MODNAME, the_object->valid_bytes[1]);
 #endif
         mutex_unlock(&(the_object->operation_synchronizer[1]));
         
-        wake_up_interruptible(&(the_object->the_wq_head[1]));    // wakes up one thread in the wait_queue of threads that are waiting for the lock
+        wake_up_readers(the_object, 1);
         kfree((void*)temp_buffer);
         return tot_written;
 
@@ -363,12 +818,13 @@ static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off)
         int ret;
         io_sess_info *sess_info;
         object_state *the_object; 
-        object_content *obj_index;
-        int read_offset;
-        int len_to_read;
-        int record_to_rem;
+        read_cursor *cursor;
+        int available;
         int total_len;
+        int replaying;
+        u64 start;
         char* temp_buffer;
+        op_deadline op;
         
         /* Preliminary check: verify that the len requested by the user actually
          * fits the buffer limits. 
@@ -378,38 +834,127 @@ static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off)
 
         the_object = objects + minor;
         sess_info = (io_sess_info *)(filp->private_data); 
+        start_operation(sess_info, &op);
+
+        if(the_object->nr_shards > 0)
+            return shard_read(minor, sess_info, &op, buff, len);
         
         /* As for the write, the amount of bytes that are actually read are limited by the available */
-        if(try_get_lock(sess_info, minor, "read") != 1)
+        if(try_get_lock(sess_info, &op, minor, "read") != 1)
            goto read_no_lock;
+        if(!sess_info->priority)
+            drain_deferred_writes(the_object);
+        expire_stream_data(the_object, sess_info->priority);
+        if(sess_info->priority && the_object->age_msecs > 0)
+            promote_aged_data(the_object);
         
         // If there are no byte and the operation can wait, do it
-        if(the_object->valid_bytes[sess_info->priority] == 0 && sess_info->timeout > 0){
+        cursor = session_cursor(the_object, sess_info);
+        replaying = replay_pending(the_object, sess_info, cursor);
+        if(!replaying && readable_bytes(the_object, sess_info->priority, cursor) == 0 && op.timeout > 0){
+            int wait_event;
+            long long wait_value;
+            handoff_req req;
+            int parked;
+
+            /* In fan-out mode the valid bytes are shared by all the cursors, so the reader waits for the tail to move */
+            wait_event = WAIT_READ;
+            wait_value = 0;
+            if(cursor != NULL){
+                wait_event = WAIT_CURSOR;
+                wait_value = (long long)cursor->offset;
+            }
+
+            /* A plain reader of the high flow parks its buffer, so that a writer can fill it directly */
+            parked = 0;
+            if(cursor == NULL && sess_info->priority && sess_info->group == NULL && handoff_allowed(the_object)){
+                req.len = min_t(size_t, len, OBJECT_MAX_SIZE*MAX_PAGES);
+                req.buffer = (char*)kmalloc(req.len, GFP_ATOMIC);
+                if(req.buffer != NULL && req.len > 0){
+                    req.filled = -1;
+                    req.task = current;
+                    spin_lock(&(the_object->handoff_lock));
+                    list_add_tail(&(req.node), &(the_object->handoff_reqs));
+                    spin_unlock(&(the_object->handoff_lock));
+                    wait_event = WAIT_HANDOFF;
+                    wait_value = (long long)(unsigned long)&req;
+                    parked = 1;
+                }
+                else
+                    kfree((void*)req.buffer);
+            }
             mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority]));
-            if(try_wait_for_data(sess_info, minor, 0, WAIT_READ) != 1)
+            wake_up_flow(the_object, sess_info->priority);
+            ret = try_wait_for_data(sess_info, &op, minor, wait_value, wait_event);
+
+            if(parked){
+                /* If a writer already took the request it is filling it, otherwise nobody can see it anymore */
+                spin_lock(&(the_object->handoff_lock));
+                parked = !list_empty(&(req.node));
+                if(parked)
+                    list_del(&(req.node));
+                spin_unlock(&(the_object->handoff_lock));
+                if(!parked){
+                    while(smp_load_acquire(&(req.filled)) < 0)
+                        cpu_relax();
+                    total_len = req.filled - copy_to_user(buff, req.buffer, req.filled);
+                    kfree((void*)req.buffer);
+                    return total_len;
+                }
+                kfree((void*)req.buffer);
+            }
+            if(ret != 1)
                 return 0;
 
-            if(try_get_lock(sess_info, minor, "read") != 1)
+            if(try_get_lock(sess_info, &op, minor, "read") != 1)
                 goto read_no_lock;
+            if(!sess_info->priority)
+                drain_deferred_writes(the_object);
+            expire_stream_data(the_object, sess_info->priority);
+            if(sess_info->priority && the_object->age_msecs > 0)
+                promote_aged_data(the_object);
         } 
 
         /* Got the lock, so from now on there is the actual read operation */
         
-        if(the_object->valid_bytes[sess_info->priority] == 0){
+        cursor = session_cursor(the_object, sess_info);
+        replaying = replay_pending(the_object, sess_info, cursor);
+        if(replaying)
+            available = (int)(((cursor != NULL) ? cursor->offset : the_object->stream_head[sess_info->priority]) - sess_info->replay_offset[sess_info->priority]);
+        else
+            available = readable_bytes(the_object, sess_info->priority, cursor);
+        if(available == 0){
             mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority]));
-            wake_up_interruptible(&(the_object->the_wq_head[sess_info->priority]));
+            wake_up_flow(the_object, sess_info->priority);
 #ifdef DEBUG_INFO
             printk("%s: device file is empty \n", MODNAME);
 #endif
             return 0;
         }
-        if (len > the_object->valid_bytes[sess_info->priority])
-            len = the_object->valid_bytes[sess_info->priority];
+        if (len > available)
+            len = available;
+
+        /* Members of a consumer group only get whole records */
+        start = (cursor != NULL) ? cursor->offset : the_object->stream_head[sess_info->priority];
+        if(replaying)
+            start = sess_info->replay_offset[sess_info->priority];
+        else if(sess_info->group != NULL){
+            ret = record_bytes(the_object, sess_info->priority, start, len);
+            if(ret < 0){
+                mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority]));
+                wake_up_flow(the_object, sess_info->priority);
+#ifdef DEBUG_INFO
+                printk("%s: the next record does not fit the buffer of the reader\n", MODNAME);
+#endif
+                return ret;
+            }
+            len = ret;
+        }
         
         temp_buffer = (char*)kzalloc(len*sizeof(char), GFP_ATOMIC);
         if(temp_buffer == NULL){
             mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority])); 
-            wake_up_interruptible(&(the_object->the_wq_head[sess_info->priority]));
+            wake_up_flow(the_object, sess_info->priority);
             goto read_no_mem;
         }
 
@@ -417,54 +962,24 @@ static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off)
         printk("%s: somebody called a read on dev with [major,minor] number [%d,%d], with offset %lld\n",MODNAME,get_major(filp),get_minor(filp), *off);
 #endif
         
-        obj_index = the_object->list_heads[sess_info->priority]->next;
-        read_offset = 0;
-        len_to_read = 0;
-        record_to_rem = 0;
-        total_len = 0;
-
-        while(len > 0){
-            len_to_read = len;
-            if(len >= (obj_index->record_length - obj_index->read_offset))
-                len_to_read = obj_index->record_length - obj_index->read_offset;
-            memcpy(&(temp_buffer[total_len]), &(obj_index->stream_content[obj_index->read_offset]), len_to_read);
-
-            obj_index->read_offset += len_to_read;
-            if (obj_index->read_offset == OBJECT_MAX_SIZE){
-                record_to_rem++;
-                obj_index = obj_index->next;
-            }
-            len -= len_to_read;
-            total_len += len_to_read;
-            read_offset += len_to_read;
-        }
-        if (record_to_rem > 0){
-            obj_index = the_object->list_heads[sess_info->priority]->next; 
-            for(; record_to_rem > 0; record_to_rem--){
-                object_content* temp = obj_index;
-                obj_index = obj_index->next;
-                free_page((unsigned long)temp->stream_content);
-                kfree((void*)temp);
-#ifdef DEBUG_INFO
-                printk("%s: removed one node\n", MODNAME);
-#endif
-            }
-            the_object->list_heads[sess_info->priority]->next = obj_index;
+        total_len = len;
+        read_stream_data(the_object, sess_info->priority, start, temp_buffer, total_len);
+        if(replaying){
+            // data read again from the retention window is not consumed
+            sess_info->replay_offset[sess_info->priority] += total_len;
         }
-        
-        // delete read data and update the number of valid bytes
-        the_object->valid_bytes[sess_info->priority] -= total_len;
-        the_object->total_free_bytes[sess_info->priority] += total_len;
-
-        if(sess_info->priority){
-            high_data_count[minor] -= total_len;
+        else if(cursor != NULL){
+            // only the cursor moves, the pages are freed once the slowest cursor has gone past them
+            cursor->offset += total_len;
+            reclaim_fanout_data(the_object, sess_info->priority);
         }
         else{
-            low_data_count[minor] -= total_len;
+            // delete read data and update the number of valid bytes
+            consume_stream_data(the_object, sess_info->priority, total_len);
         }
         
         mutex_unlock(&(the_object->operation_synchronizer[sess_info->priority])); 
-        wake_up_interruptible(&(the_object->the_wq_head[sess_info->priority]));    // wakes up one thread in the wait_queue of threads that are waiting for the lock
+        wake_up_flow(the_object, sess_info->priority);
 
 #ifdef DEBUG_INFO
         printk("%s: Read operation completed, returning %d\n", MODNAME, total_len);
@@ -504,11 +1019,143 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
         object_state *the_object;
         io_sess_info *sess_info;
         int prev_prio;  //used in case that the op changes the priority
+        long ret;
+        retention_info retention;
+        link_stats_info link_stats;
+        op_deadline op;
 
         the_object = objects + minor;
         sess_info = (io_sess_info *)(filp->private_data);
+
+        /* Commands that change the state of both the flows of the device file take the locks by themselves */
+        switch (command){
+            case SET_FANOUT:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_FANOUT, with param: %ld\n", MODNAME, param);
+#endif
+                return set_fanout_mode(minor, param);
+            case JOIN_GROUP:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was JOIN_GROUP\n", MODNAME);
+#endif
+                return join_group(minor, sess_info, (const char __user *)param);
+            case GET_WRITE_OFFSET:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was GET_WRITE_OFFSET\n", MODNAME);
+#endif
+                if(put_user(sess_info->write_offset, (u64 __user *)param))
+                    return -EFAULT;
+                return 0;
+            case LINK_MINOR:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was LINK_MINOR, with param: %ld\n", MODNAME, param);
+#endif
+                return link_minor(minor, sess_info->priority, param);
+            case UNLINK_MINOR:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was UNLINK_MINOR, with param: %ld\n", MODNAME, param);
+#endif
+                return unlink_minor(minor, sess_info->priority, param);
+            case SET_SHARDS:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_SHARDS\n", MODNAME);
+#endif
+                return set_shard_group(minor, (const void __user *)param);
+            case MULTI_READ:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was MULTI_READ\n", MODNAME);
+#endif
+                return multi_read(sess_info, (const void __user *)param);
+            case SET_RATE_LIMIT:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_RATE_LIMIT\n", MODNAME);
+#endif
+                return set_rate_limit(minor, sess_info, (const void __user *)param);
+            case SET_AGING:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_AGING, with param: %ld\n", MODNAME, param);
+#endif
+                set_aging(minor, param);
+                return 0;
+            case GET_WAIT_STATS:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was GET_WAIT_STATS\n", MODNAME);
+#endif
+                return get_wait_stats(sess_info, (void __user *)param);
+            case SET_TIMEOUT_NS:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_TIMEOUT_NS, with param: %ld\n", MODNAME, param);
+#endif
+                sess_info->timeout_ns = param;
+                return 0;
+            case SET_NEXT_TIMEOUT_NS:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_NEXT_TIMEOUT_NS, with param: %ld\n", MODNAME, param);
+#endif
+                WRITE_ONCE(sess_info->next_timeout_ns, (param == NO_NEXT_TIMEOUT) ? param - 1 : param);
+                return 0;
+            case SET_ORDERING:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_ORDERING, with param: %ld\n", MODNAME, param);
+#endif
+                sess_info->relaxed_order = (param != 0);
+                return 0;
+            case SYNC_WRITES:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SYNC_WRITES, with param: %ld\n", MODNAME, param);
+#endif
+                start_operation(sess_info, &op);
+                return sync_deferred_writes(minor, sess_info, &op, param != 0, 0);
+            case SET_SPILL:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_SPILL\n", MODNAME);
+#endif
+                return set_spill(minor, sess_info->priority, (const void __user *)param);
+            case SET_WORKER:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_WORKER\n", MODNAME);
+#endif
+                return set_worker(minor, (const void __user *)param);
+            case SET_BATCH:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_BATCH\n", MODNAME);
+#endif
+                return set_batch(minor, (const void __user *)param);
+            case OPEN_COMPLETIONS:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was OPEN_COMPLETIONS\n", MODNAME);
+#endif
+                return open_completions(minor, sess_info);
+            case SET_OPENCLOSE:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_OPENCLOSE, with param: %ld\n", MODNAME, param);
+#endif
+                return set_open_close(minor, param);
+            case QUIESCE:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was QUIESCE\n", MODNAME);
+#endif
+                return quiesce_device((void __user *)param);
+            case EXPORT_IMAGE:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was EXPORT_IMAGE\n", MODNAME);
+#endif
+                return export_image((void __user *)param);
+            case IMPORT_IMAGE:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was IMPORT_IMAGE\n", MODNAME);
+#endif
+                return import_image((void __user *)param);
+            case SET_SPIN_USECS:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_SPIN_USECS, with param: %ld\n", MODNAME, param);
+#endif
+                sess_info->spin_usecs = param;
+                return 0;
+        }
         
-        if(try_get_lock(sess_info, minor, "ioctl") != 1){
+        start_operation(sess_info, &op);
+        if(try_get_lock(sess_info, &op, minor, "ioctl") != 1){
 #ifdef DEBUG_INFO
             printk("%s: ioctl could not get the lock\n", MODNAME);
 #endif
@@ -537,25 +1184,182 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
 #ifdef DEBUG_INFO
                 printk("%s: ioctl command called was SET_BLOCKING, with param: %ld\n", MODNAME, param);
 #endif
-                sess_info->timeout = param;
+                sess_info->timeout_ns = ((long)param > 0) ? jiffies_to_nsecs(param) : 0;
                 break;
-            case SET_OPENCLOSE:  
+            case SET_RETENTION:
 #ifdef DEBUG_INFO
-                printk("%s: ioctl command called was SET_OPENCLOSE, with param: %ld\n", MODNAME, param);
+                printk("%s: ioctl command called was SET_RETENTION\n", MODNAME);
+#endif
+                if(copy_from_user(&retention, (void __user *)param, sizeof(retention_info))){
+                    ret = -EFAULT;
+                    goto ioctl_out;
+                }
+                if(retention.bytes > OBJECT_MAX_SIZE*MAX_RETAIN_PAGES){
+                    ret = -1;
+                    goto ioctl_out;
+                }
+                the_object->retain_bytes[prev_prio] = retention.bytes;
+                the_object->retain_msecs[prev_prio] = retention.msecs;
+                trim_stream_data(the_object, prev_prio);    // the window could have been reduced
+                break;
+            case SET_SHARD_KEY:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_SHARD_KEY, with param: %ld\n", MODNAME, param);
 #endif
-                enable_disable_array[minor] = param; // enables or disables the device file
+                sess_info->shard_key = param;
                 break;
+            case SET_TTL:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_TTL, with param: %ld\n", MODNAME, param);
+#endif
+                the_object->ttl_msecs[prev_prio] = param;
+                if(param > 0){
+                    expire_stream_data(the_object, prev_prio);
+                    schedule_delayed_work(&expiry_work, msecs_to_jiffies(EXPIRY_SWEEP_MSECS));
+                }
+                break;
+            case SET_OVERWRITE:
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was SET_OVERWRITE, with param: %ld\n", MODNAME, param);
+#endif
+                the_object->overwrite = (param != 0);
+                break;
+            case GET_MISSED:
+            {
+                read_cursor *cursor;
+                u64 missed;
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was GET_MISSED\n", MODNAME);
+#endif
+                /* Readers with a cursor lose data only if they were behind, destructive readers share the losses of the flow */
+                cursor = (sess_info->group != NULL) ? &(sess_info->group->cursors[prev_prio]) : &(sess_info->cursors[prev_prio]);
+                if(the_object->fanout && cursor->active){
+                    missed = cursor->missed;
+                    cursor->missed = 0;
+                }
+                else{
+                    missed = the_object->dropped_total[prev_prio] - sess_info->dropped_seen[prev_prio];
+                    sess_info->dropped_seen[prev_prio] = the_object->dropped_total[prev_prio];
+                }
+                if(put_user(missed, (u64 __user *)param)){
+                    ret = -EFAULT;
+                    goto ioctl_out;
+                }
+                break;
+            }
+            case GET_LINKS:
+            {
+                int j;
+#ifdef DEBUG_INFO
+                printk("%s: ioctl command called was GET_LINKS\n", MODNAME);
+#endif
+                memset(&link_stats, 0, sizeof(link_stats_info));
+                link_stats.nr_links = the_object->nr_links[prev_prio];
+                for(j=0;j<the_object->nr_links[prev_prio];j++){
+                    mirror_link *link = &(the_object->links[prev_prio][j]);
+                    link_stats.links[j].minor = link->minor;
+                    link_stats.links[j].mirrored_bytes = link->mirrored_bytes;
+                    link_stats.links[j].dropped_bytes = link->dropped_bytes;
+                    link_stats.links[j].lag = objects[link->minor].valid_bytes[prev_prio];  // read without the lock, just a snapshot
+                }
+                if(copy_to_user((void __user *)param, &link_stats, sizeof(link_stats_info))){
+                    ret = -EFAULT;
+                    goto ioctl_out;
+                }
+                break;
+            }
             default: 
 #ifdef DEBUG_INFO
                 printk("%s: Ioctl called, but the given user command [%d], is not supported by this driver\n", MODNAME, command);
 #endif
                 mutex_unlock(&(the_object->operation_synchronizer[prev_prio])); 
-                wake_up_interruptible(&(the_object->the_wq_head[prev_prio]));
+                wake_up_flow(the_object, prev_prio);
                 return -1;
         }
+        ret = 0;
+
+ioctl_out:
         mutex_unlock(&(the_object->operation_synchronizer[prev_prio]));
-        wake_up_interruptible(&(the_object->the_wq_head[prev_prio]));
-        return 0;
+        wake_up_flow(the_object, prev_prio);
+        return ret;
+}
+
+
+/** dev_llseek - move the read position of the session on its current flow, using logical stream offsets.
+ *  A position behind the data still to be read makes the next reads return the retained data again, without consuming it. 
+ *  In fan-out mode the cursor of the session can also be moved forward, up to the tail of the flow.
+ *  @filp: pointer to a file struct
+ *  @offset: offset, interpreted according to whence
+ *  @whence: SEEK_SET, SEEK_CUR (from the current read position) or SEEK_END (from the tail of the flow)
+ *
+ *  Returns: the new position, or a negative error code if it is out of the readable data
+ *  */
+static loff_t dev_llseek(struct file *filp, loff_t offset, int whence){
+        int minor = get_minor(filp);
+        object_state *the_object;
+        io_sess_info *sess_info;
+        read_cursor *cursor;
+        int priority;
+        u64 current_pos;
+        u64 limit;
+        loff_t pos;
+        op_deadline op;
+
+        the_object = objects + minor;
+        sess_info = (io_sess_info *)(filp->private_data);
+        start_operation(sess_info, &op);
+
+        if(try_get_lock(sess_info, &op, minor, "llseek") != 1)
+            return -EBUSY;
+        priority = sess_info->priority;
+
+        /* Data before the limit has already been read by the session, the one after it has not */
+        cursor = session_cursor(the_object, sess_info);
+        limit = (cursor != NULL) ? cursor->offset : the_object->stream_head[priority];
+        current_pos = limit;
+        if(replay_pending(the_object, sess_info, cursor))
+            current_pos = sess_info->replay_offset[priority];
+
+        switch (whence){
+            case SEEK_SET:
+                pos = offset;
+                break;
+            case SEEK_CUR:
+                pos = (loff_t)current_pos + offset;
+                break;
+            case SEEK_END:
+                pos = (loff_t)the_object->stream_tail[priority] + offset;
+                break;
+            default:
+                pos = -EINVAL;
+                goto llseek_out;
+        }
+
+        if(pos < (loff_t)the_object->retain_head[priority] || pos > (loff_t)the_object->stream_tail[priority]){
+            pos = -EINVAL;
+            goto llseek_out;
+        }
+        if(pos <= (loff_t)limit){
+            sess_info->replay_offset[priority] = pos;
+            sess_info->replay_active[priority] = (pos < (loff_t)limit);
+        }
+        else if(cursor != NULL){
+            // the data skipped by the cursor can now be freed, if nobody else needs it
+            cursor->offset = pos;
+            sess_info->replay_active[priority] = 0;
+            reclaim_fanout_data(the_object, priority);
+        }
+        else{
+            // destructive reads cannot skip data
+            pos = -EINVAL;
+            goto llseek_out;
+        }
+        filp->f_pos = pos;
+
+llseek_out:
+        mutex_unlock(&(the_object->operation_synchronizer[priority]));
+        wake_up_flow(the_object, priority);
+        return pos;
 }
 
 
@@ -566,15 +1370,13 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
  * @data: address of the parameter passed in the __INIT_WORK 
  * */
 void do_wq_write(unsigned long data){
-        char *buffer;
+        packed_data_wq *the_wq;
         object_state *the_object;
-        size_t tot_bytes;
         int minor;
 
-        buffer = (char *)(container_of((void*)data, packed_data_wq, the_work)->data);
-        minor = (int)(container_of((void*)data, packed_data_wq, the_work)->minor);
+        the_wq = container_of((void*)data, packed_data_wq, the_work);
+        minor = the_wq->minor;
         the_object = objects + minor;   // get the right object
-        tot_bytes = (size_t)(container_of((void*)data, packed_data_wq, the_work)->len);    // get the number of bytes to copy
 
         mutex_lock(&(the_object->operation_synchronizer[0]));
 
@@ -582,24 +1384,29 @@ void do_wq_write(unsigned long data){
         printk("%s: Work queue called to write on the buffer\n", MODNAME);
 #endif
 
-        write_data(tot_bytes, minor, buffer, 0);
-        the_object->valid_bytes[0] += tot_bytes;
+        /* A reader, or the work of a later write, could have already appended the data. Otherwise the writes submitted
+         * before this one are appended first, unless the ordering was relaxed */
+        if(!the_wq->done && !the_wq->relaxed){
+            while(!the_wq->done)
+                run_deferred_write(the_object, list_first_entry(&(the_object->deferred_writes), packed_data_wq, node));
+        }
+        else if(!the_wq->done)
+            run_deferred_write(the_object, the_wq);
 #ifdef AUTID 
         printk("%s: Work queue terminated \n", MODNAME);
 #endif
-        low_data_count[minor] += tot_bytes;
         
         mutex_unlock(&(the_object->operation_synchronizer[0])); 
-        wake_up_interruptible(&(the_object->the_wq_head[0]));    // wakes up one thread in the wait_queue of threads that are waiting for the lock
+        wake_up_readers(the_object, 0);
         
-        kfree((void*)container_of((void*)data, packed_data_wq, the_work)->data);
-        kfree((void *)container_of((void*)data, packed_data_wq, the_work));
+        kfree((void*)the_wq->data);
+        kfree((void *)the_wq);
         module_put(THIS_MODULE);
 }
 
 
 /** do_sleep_wqe - Put the current thread to sleep while it is waiting to get the lock. The wait is on a wait event queue
- * @timeout: the timeout (in microseconds) after which the thread will wake up
+ * @timeout: the timeout (in nanoseconds) after which the thread will wake up
  * @minor: the minor number of the device file
  * @priority: priority level of the dta flow
  * @type: refers to the wakeup condition
@@ -610,7 +1417,7 @@ void do_wq_write(unsigned long data){
  * * 1 otherwhise.
  * 
  * */
-int do_sleep_wqe(long op_timeout, int minor, int priority, int value, int event){
+int do_sleep_wqe(u64 op_timeout, int minor, int priority, long long value, int event){
         object_state *the_object;
         int res; 
 
@@ -618,26 +1425,38 @@ int do_sleep_wqe(long op_timeout, int minor, int priority, int value, int event)
         res = 0; 
 
 #ifdef DEBUG_INFO
-        printk("%s: the current thread (%d) is going to sleep for %lu jiffies\n", MODNAME, current->pid, op_timeout);
+        printk("%s: the current thread (%d) is going to sleep for %llu ns\n", MODNAME, current->pid, (unsigned long long)op_timeout);
 #endif
         
         switch (event){
             case WAIT_MUTEX:
-                res = wait_event_interruptible_timeout_exclusive(the_object->the_wq_head[priority], mutex_trylock(&(the_object->operation_synchronizer[priority])) == value, op_timeout);
+                res = wait_event_interruptible_hrtimeout_exclusive(the_object->the_wq_head[priority], fair_lock_ready(the_object, priority) == value, ns_to_ktime(op_timeout));
                 break;
 
             case WAIT_WRITE: 
-                res = wait_event_interruptible_timeout_exclusive(the_object->the_wq_head[priority], (the_object->total_free_bytes[priority]) > value, op_timeout);
+                res = wait_event_interruptible_hrtimeout_exclusive(the_object->the_wq_head[priority], (the_object->total_free_bytes[priority]) > value, ns_to_ktime(op_timeout));
                 break; 
             
             case WAIT_READ: 
-                res = wait_event_interruptible_timeout_exclusive(the_object->the_wq_head[priority], (the_object->valid_bytes[priority]) > value, op_timeout);
+                res = wait_event_interruptible_hrtimeout_exclusive(the_object->the_wq_head[priority], wait_condition(minor, priority, value, event), ns_to_ktime(op_timeout));
+                break;
+
+            case WAIT_CURSOR:
+                res = wait_event_interruptible_hrtimeout_exclusive(the_object->the_wq_head[priority], (long long)(the_object->stream_tail[priority]) > value, ns_to_ktime(op_timeout));
+                break;
+
+            case WAIT_SHARDS:
+                res = wait_event_interruptible_hrtimeout_exclusive(the_object->the_wq_head[priority], shard_has_data(minor, priority), ns_to_ktime(op_timeout));
+                break;
+
+            case WAIT_HANDOFF:
+                res = wait_event_interruptible_hrtimeout_exclusive(the_object->the_wq_head[priority], wait_condition(minor, priority, value, event), ns_to_ktime(op_timeout));
                 break;
         }
         
 
-        /* The thread exited from the wait queue. This could happen either because the condition was or was not satisfied, or
-         * due to a signal was received 
+        /* The thread exited from the wait queue. This could happen either because the condition was satisfied (0), or the 
+         * hrtimer expired (-ETIME), or due to a signal was received 
          * */
         if(res == -ERESTARTSYS){
 #ifdef DEBUG_INFO
@@ -645,7 +1464,7 @@ int do_sleep_wqe(long op_timeout, int minor, int priority, int value, int event)
 #endif
             return -EINTR;
         }
-        if (res){
+        if (res == 0){
 #ifdef DEBUG_INFO
             printk("%s: thread %d exiting successfully from sleep \n", MODNAME, current->pid);
 #endif
@@ -693,7 +1512,6 @@ static ssize_t write_data(size_t len, int minor, char* buffer, int priority){
                 goto dev_write_no_mem;
             }
             new_first_page->record_length = 0;
-            new_first_page->read_offset = 0;
             new_first_page->next = NULL;
             the_object->list_heads[priority]->next = new_first_page;
         }
@@ -722,7 +1540,6 @@ static ssize_t write_data(size_t len, int minor, char* buffer, int priority){
                 }
                 
                 new_record->record_length = 0;
-                new_record->read_offset = 0;
                 new_record->next = NULL;
                 temp_object->next = new_record;
                 temp_object = temp_object->next;
@@ -777,51 +1594,2877 @@ dev_write_no_mem:
  * * 0 in case of failure
  *
  * */
-int try_get_lock(io_sess_info* sess_info, int minor, const char* operation){
-        object_state* the_object;
-        the_object = objects + minor;
-        if(mutex_trylock(&(the_object->operation_synchronizer[sess_info->priority])) != 1){
-            if (sess_info->timeout <= 0)   // this means that the operation is in blocking mode
-                return 0;
-                
-#ifdef DEBUG_INFO
-            printk("%s: %s is going to sleep because the lock is not available\n", MODNAME, operation);
-#endif
-            if(do_sleep_wqe(sess_info->timeout, minor, sess_info->priority, 1, WAIT_MUTEX) != 1)
-                return 0;
-            return 1;
-        }
+int try_get_lock(io_sess_info* sess_info, op_deadline *op, int minor, const char* operation){
+        return try_get_flow_lock(sess_info, op, minor, sess_info->priority, operation);
+}
+
+
+/** try_get_flow_lock - same as try_get_lock, for a flow that is not the current one of the session.
+ * @sess_info: io_sess_info struct, containing session information of the calling thread
+ * @op: deadline of the operation
+ * @minor: minor number of the device file
+ * @priority: data flow priority
+ *
+ * Return:
+ * * 1 in case of success,
+ * * 0 in case of failure
+ *
+ * */
+static int try_get_flow_lock(io_sess_info* sess_info, op_deadline *op, int minor, int priority, const char* operation){
+        object_state* the_object;
+        queue_elem elem;
+        ktime_t start;
+        u64 waited;
+        int ret;
+
+        the_object = objects + minor;
+
+        // the lock can be taken right away only if nobody is queued for it, otherwise the caller would barge ahead
+        if(READ_ONCE(the_object->lock_queue_head[priority]) == NULL && mutex_trylock(&(the_object->operation_synchronizer[priority])) == 1)
+            return 1;
+        if (op->timeout == 0)   // this means that the operation is in non blocking mode
+            return 0;
+        if(spin_wait(sess_info, op, minor, priority, 1, WAIT_MUTEX) == 1)
+            return 1;
+
+#ifdef DEBUG_INFO
+        printk("%s: %s is going to sleep because the lock is not available\n", MODNAME, operation);
+#endif
+        elem.the_task = current;
+        elem.already_hit = 0;
+        elem.next = NULL;
+        spin_lock(&(the_object->lock_queue_lock[priority]));
+        elem.prev = the_object->lock_queue_tail[priority];
+        if(elem.prev != NULL)
+            elem.prev->next = &elem;
+        else
+            the_object->lock_queue_head[priority] = &elem;
+        the_object->lock_queue_tail[priority] = &elem;
+        spin_unlock(&(the_object->lock_queue_lock[priority]));
+
+        start = ktime_get();
+        ret = do_sleep_wqe(remaining_timeout(op), minor, priority, 1, WAIT_MUTEX);
+        waited = ktime_us_delta(ktime_get(), start);
+
+        spin_lock(&(the_object->lock_queue_lock[priority]));
+        if(elem.prev != NULL)
+            elem.prev->next = elem.next;
+        else
+            the_object->lock_queue_head[priority] = elem.next;
+        if(elem.next != NULL)
+            elem.next->prev = elem.prev;
+        else
+            the_object->lock_queue_tail[priority] = elem.prev;
+        spin_unlock(&(the_object->lock_queue_lock[priority]));
+
+        sess_info->lock_waits++;
+        sess_info->lock_wait_total += waited;
+        if(waited > sess_info->lock_wait_max)
+            sess_info->lock_wait_max = waited;
+
+        if(ret != 1){
+            /* The thread gave up while at the head of the queue: the lock could be free, so the next one is woken */
+            sess_info->lock_timeouts++;
+            if(elem.prev == NULL)
+                wake_up_flow(the_object, priority);
+            return 0;
+        }
+        return 1;
+}
+
+
+/** try_wait_for_data - put the thread in the wait queue for a read/write operation that cannot read or write 
+ *  due to lack of space on the device file or lack of data.
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @op: deadline of the operation, the wait gets the time left
+ *  @minor: minor number of the device file
+ *  @value: value checked for the wait condition
+ *  @event: sleep event, can be
+ *   - WAIT_WRITE
+ *   - WAIT_READ
+ *   - WAIT_CURSOR (the value is the logical offset of the reader cursor)
+ *   - WAIT_SHARDS (minor is a shard leader, the value is not used)
+ *   - WAIT_HANDOFF (the value is the handoff_req of the parked reader)
+ *
+ *   Return:
+ *    - 1 in case of success
+ *    - 0 in case of failure
+ *  */
+int try_wait_for_data(io_sess_info* sess_info, op_deadline *op, int minor, long long value, int event){
+        int ret; 
+        if (sess_info->priority)
+             high_wait_data[minor] += 1;
+         else
+             low_wait_data[minor] += 1;
+
+        ret = spin_wait(sess_info, op, minor, sess_info->priority, value, event);
+        if(ret != 1)
+            ret = do_sleep_wqe(remaining_timeout(op), minor, sess_info->priority, value, event);
+        if (sess_info->priority)
+             high_wait_data[minor] -= 1;
+         else
+             low_wait_data[minor] -= 1;
+
+         return ret;
+}
+
+
+/** read_stream_data - copy data out of a flow starting from a logical stream offset, without consuming it.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @offset: logical offset of the first byte to copy, it must lay between stream_head and stream_tail
+ *  @buffer: kernel buffer where the data is copied
+ *  @len: number of bytes to copy
+ *  */
+static void read_stream_data(object_state *the_object, int priority, u64 offset, char *buffer, int len){
+        object_content *obj_index;
+        u64 skip;
+        int page_offset;
+        int len_to_read;
+        int total_len;
+
+        /* All the pages before the last one are full, so the page holding the offset is found by counting pages */
+        obj_index = the_object->list_heads[priority]->next;
+        skip = offset - the_object->chain_base[priority];
+        while(skip >= OBJECT_MAX_SIZE){
+            obj_index = obj_index->next;
+            skip -= OBJECT_MAX_SIZE;
+        }
+        page_offset = (int)skip;
+        total_len = 0;
+
+        while(len > 0){
+            len_to_read = len;
+            if(len_to_read > (obj_index->record_length - page_offset))
+                len_to_read = obj_index->record_length - page_offset;
+            memcpy(&(buffer[total_len]), &(obj_index->stream_content[page_offset]), len_to_read);
+
+            len -= len_to_read;
+            total_len += len_to_read;
+            obj_index = obj_index->next;
+            page_offset = 0;
+        }
+}
+
+
+/** consume_stream_data - drop the first bytes of a flow, freeing the pages that have been completely consumed.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @len: number of bytes to drop, at most valid_bytes
+ *  */
+static void consume_stream_data(object_state *the_object, int priority, int len){
+        int minor;
+
+        minor = the_object - objects;
+        the_object->stream_head[priority] += len;
+        the_object->valid_bytes[priority] -= len;
+        if(priority)
+            high_data_count[minor] -= len;
+        else
+            low_data_count[minor] -= len;
+        give_back_free_bytes(the_object, priority, len);
+
+        trim_stream_data(the_object, priority);
+}
+
+
+/** give_back_free_bytes - add bytes to the free space of a flow. If the flow has spilled records they may fit now, so
+ *  the spill work is scheduled. Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @len: number of bytes given back
+ *  */
+static void give_back_free_bytes(object_state *the_object, int priority, int len){
+        the_object->total_free_bytes[priority] += len;
+        if(the_object->spill_bytes[priority] > 0)
+            schedule_work(&(the_object->spill_work));  // there is room for the spilled records
+}
+
+
+/** trim_stream_data - free the pages and the record descriptors that are behind both the head of the flow and
+ *  its retention window. The window keeps at most retain_bytes of consumed data (MAX_RETAIN_PAGES if only the time
+ *  limit is set), and if retain_msecs is set, only the records written in the last retain_msecs milliseconds.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  */
+static void trim_stream_data(object_state *the_object, int priority){
+        object_content *obj_index;
+        record_desc *record;
+        u64 boundary;
+        u64 head;
+        u64 max_retain;
+        ktime_t limit;
+
+        head = the_object->stream_head[priority];
+        boundary = head;
+        if(the_object->retain_bytes[priority] > 0 || the_object->retain_msecs[priority] > 0){
+            max_retain = the_object->retain_bytes[priority];
+            if(max_retain == 0)
+                max_retain = OBJECT_MAX_SIZE*MAX_RETAIN_PAGES;  // a window in time only is still bounded in space
+            boundary = the_object->retain_head[priority];
+            if(head - boundary > max_retain)
+                boundary = head - max_retain;
+
+            if(the_object->retain_msecs[priority] > 0){
+                limit = ktime_sub(ktime_get(), ms_to_ktime(the_object->retain_msecs[priority]));
+                list_for_each_entry(record, &(the_object->records[priority]), node){
+                    if(record->end_offset > head || ktime_after(record->stamp, limit))
+                        break;
+                    if(record->end_offset > boundary)
+                        boundary = record->end_offset;
+                }
+            }
+        }
+        the_object->retain_head[priority] = boundary;
+
+        // the records that are completely behind the boundary are not needed anymore
+        while(!list_empty(&(the_object->records[priority]))){
+            record = list_first_entry(&(the_object->records[priority]), record_desc, node);
+            if(record->end_offset > boundary)
+                break;
+            list_del(&(record->node));
+            kfree((void*)record);
+        }
+
+        obj_index = the_object->list_heads[priority]->next;
+        while(obj_index != NULL && obj_index->record_length == OBJECT_MAX_SIZE && the_object->chain_base[priority] + OBJECT_MAX_SIZE <= boundary){
+            object_content* temp = obj_index;
+            obj_index = obj_index->next;
+            the_object->chain_base[priority] += OBJECT_MAX_SIZE;
+            free_page((unsigned long)temp->stream_content);
+            kfree((void*)temp);
+#ifdef DEBUG_INFO
+            printk("%s: removed one node\n", MODNAME);
+#endif
+        }
+        the_object->list_heads[priority]->next = obj_index;
+}
+
+
+/** drop_stream_data - drop the oldest data of a flow even if it has not been read yet. The cursors that were behind
+ *  the new head are moved to it, and the bytes they lost are added to their missed counter.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @len: number of bytes to drop, at most valid_bytes
+ *  */
+static void drop_stream_data(object_state *the_object, int priority, int len){
+        read_cursor *cursor;
+        u64 new_head;
+
+        new_head = the_object->stream_head[priority] + len;
+        list_for_each_entry(cursor, &(the_object->cursors[priority]), node){
+            if(cursor->offset < new_head){
+                cursor->missed += new_head - cursor->offset;
+                cursor->offset = new_head;
+            }
+        }
+        the_object->dropped_total[priority] += len;
+        consume_stream_data(the_object, priority, len);
+}
+
+
+/** make_room - in overwrite mode, drop the oldest records of the flow until len bytes can be written (or the flow is 
+ *  empty). Whole records are dropped, so that readers never restart in the middle of one. On the low flow the pending
+ *  deferred writes are appended first, so that the space they reserved can be reclaimed as well.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @len: number of bytes that the writer needs
+ *
+ *  Return: the number of dropped bytes
+ *  */
+static int make_room(object_state *the_object, int priority, size_t len){
+        record_desc *record;
+        u64 new_head;
+        int to_drop;
+
+        if(len <= the_object->total_free_bytes[priority])
+            return 0;
+        if(priority == 0 && the_object->deferred_bytes > 0)
+            drain_deferred_writes(the_object);
+        if(the_object->valid_bytes[priority] == 0)
+            return 0;
+
+        to_drop = len - the_object->total_free_bytes[priority];
+        if(to_drop > the_object->valid_bytes[priority])
+            to_drop = the_object->valid_bytes[priority];
+
+        new_head = the_object->stream_head[priority] + to_drop;
+        list_for_each_entry(record, &(the_object->records[priority]), node){
+            if(record->end_offset >= new_head){
+                to_drop = (int)(record->end_offset - the_object->stream_head[priority]);
+                break;
+            }
+        }
+        drop_stream_data(the_object, priority, to_drop);
+#ifdef DEBUG_INFO
+        printk("%s: overwrite mode, dropped %d bytes\n", MODNAME, to_drop);
+#endif
+        return to_drop;
+}
+
+
+/** append_to_flow - append data at the tail of a flow, updating its logical offsets and its records. The free bytes 
+ *  are left to the caller, since for the low flow they are already reserved when the deferred write is submitted.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @buffer: kernel buffer with the data
+ *  @len: number of bytes to append, at most total_free_bytes (plus the reserved ones)
+ *
+ *  Return: the number of bytes appended, or -ENOMEM
+ *  */
+static int append_to_flow(object_state *the_object, int priority, char *buffer, size_t len){
+        int minor;
+        int tot_written;
+
+        minor = the_object - objects;
+        tot_written = write_data(len, minor, buffer, priority);
+        if(tot_written < 0)
+            return tot_written;
+
+        the_object->valid_bytes[priority] += tot_written;
+        the_object->stream_tail[priority] += tot_written;
+        add_record(the_object, priority);
+        if(priority)
+            high_data_count[minor] += tot_written;
+        else
+            low_data_count[minor] += tot_written;
+        return tot_written;
+}
+
+
+/** wake_up_readers - wake up the threads waiting on a flow after new data was appended. In fan-out mode every reader
+ *  has to see the new data, not only the first one in the queue.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  */
+static void wake_up_readers(object_state *the_object, int priority){
+        int leader;
+
+        if(the_object->fanout)
+            wake_up_interruptible_all(&(the_object->the_wq_head[priority]));
+        else
+            wake_up_flow(the_object, priority);
+
+        // the readers of a shard group sleep on the queue of the leader
+        leader = READ_ONCE(the_object->shard_leader);
+        if(leader >= 0 && objects + leader != the_object)
+            wake_up_interruptible(&(objects[leader].the_wq_head[priority]));
+
+        // full barrier after the data update, so that a MULTI_READ going to sleep either sees the data or is woken
+        if(wq_has_sleeper(&multi_wq_head))
+            wake_up_interruptible_all(&multi_wq_head);
+}
+
+
+/** mirror_write - append the data just accepted by a flow to the same flow of all its mirror destinations. 
+ *  A destination that has no room for the whole write (after making room in overwrite mode) drops it, and so does a
+ *  disabled or quiesced one. On the low flow the record goes after the deferred writes already submitted to the
+ *  destination, and to its spill file when the destination is spilling.
+ *  Must be called with the lock of the source flow held, the destinations are never sources so the lock order is fixed.
+ *  @the_object: object_state of the source device file
+ *  @priority: data flow priority
+ *  @buffer: kernel buffer with the data
+ *  @len: number of bytes accepted by the source
+ *  */
+static void mirror_write(object_state *the_object, int priority, char *buffer, size_t len){
+        object_state *dest;
+        mirror_link *link;
+        int appended;
+        int dropped;
+        int j;
+
+        for(j=0;j<the_object->nr_links[priority];j++){
+            link = &(the_object->links[priority][j]);
+            dest = objects + link->minor;
+
+            mutex_lock(&(dest->operation_synchronizer[priority]));
+            if(enable_disable_array[link->minor] || READ_ONCE(quiesced)){
+                link->dropped_bytes += len;
+                mutex_unlock(&(dest->operation_synchronizer[priority]));
+                wake_up_flow(dest, priority);
+                continue;
+            }
+            appended = (priority == 0) ? drain_deferred_writes(dest) : 0;   // the record goes after them
+            if(dest->overwrite){
+                dropped = make_room(dest, priority, len);
+                if(priority)
+                    high_dropped_bytes[link->minor] += dropped;
+                else
+                    low_dropped_bytes[link->minor] += dropped;
+            }
+            if(spill_needed(dest, priority, len)){
+                if(spill_write(dest, priority, NULL, buffer, len) < 0)
+                    link->dropped_bytes += len;
+                else
+                    link->mirrored_bytes += len;
+            }
+            else if(len > dest->total_free_bytes[priority] || append_to_flow(dest, priority, buffer, len) < 0)
+                link->dropped_bytes += len;
+            else{
+                dest->total_free_bytes[priority] -= len;
+                if(priority == 0)
+                    dest->submit_tail = dest->stream_tail[0];
+                link->mirrored_bytes += len;
+                appended += len;
+            }
+            mutex_unlock(&(dest->operation_synchronizer[priority]));
+            if(appended > 0)
+                wake_up_readers(dest, priority);
+            wake_up_flow(dest, priority);
+        }
+}
+
+
+/** link_minor - mirror a flow of a device file to the same flow of another one.
+ *  @minor: minor number of the source device file
+ *  @priority: data flow priority
+ *  @param: minor number of the destination
+ *
+ *  Return: 0 in case of success, -1 if the link is not valid (it would create a chain or a cycle, it already exists
+ *  or the flow has already MAX_LINKS links)
+ *  */
+static int link_minor(int minor, int priority, unsigned long param){
+        object_state *the_object;
+        int j;
+
+        if(param >= MINORS || param == minor)
+            return -1;
+
+        the_object = objects + minor;
+        mutex_lock(&links_lock);
+        if(the_object->mirror_sources > 0 || objects[param].nr_links[0] > 0 || objects[param].nr_links[1] > 0)
+            goto link_failure;
+
+        mutex_lock(&(the_object->operation_synchronizer[priority]));
+        for(j=0;j<the_object->nr_links[priority];j++){
+            if(the_object->links[priority][j].minor == param){
+                mutex_unlock(&(the_object->operation_synchronizer[priority]));
+                wake_up_flow(the_object, priority);
+                goto link_failure;
+            }
+        }
+        if(the_object->nr_links[priority] == MAX_LINKS){
+            mutex_unlock(&(the_object->operation_synchronizer[priority]));
+            wake_up_flow(the_object, priority);
+            goto link_failure;
+        }
+        the_object->links[priority][j].minor = (int)param;
+        the_object->links[priority][j].mirrored_bytes = 0;
+        the_object->links[priority][j].dropped_bytes = 0;
+        the_object->nr_links[priority]++;
+        mutex_unlock(&(the_object->operation_synchronizer[priority]));
+        wake_up_flow(the_object, priority);
+
+        objects[param].mirror_sources++;
+        mutex_unlock(&links_lock);
+        return 0;
+
+link_failure:
+        mutex_unlock(&links_lock);
+#ifdef DEBUG_INFO
+        printk("%s: minor %d cannot be linked to minor %ld\n", MODNAME, minor, param);
+#endif
+        return -1;
+}
+
+
+/** unlink_minor - stop mirroring a flow of a device file to another one.
+ *  @minor: minor number of the source device file
+ *  @priority: data flow priority
+ *  @param: minor number of the destination
+ *
+ *  Return: 0 in case of success, -1 if the link does not exist
+ *  */
+static int unlink_minor(int minor, int priority, unsigned long param){
+        object_state *the_object;
+        int j;
+
+        the_object = objects + minor;
+        mutex_lock(&links_lock);
+        mutex_lock(&(the_object->operation_synchronizer[priority]));
+        for(j=0;j<the_object->nr_links[priority];j++){
+            if(the_object->links[priority][j].minor == param)
+                break;
+        }
+        if(j == the_object->nr_links[priority]){
+            mutex_unlock(&(the_object->operation_synchronizer[priority]));
+            wake_up_flow(the_object, priority);
+            mutex_unlock(&links_lock);
+            return -1;
+        }
+        // keep the array compact, moving the last link in place of the removed one
+        the_object->nr_links[priority]--;
+        the_object->links[priority][j] = the_object->links[priority][the_object->nr_links[priority]];
+        mutex_unlock(&(the_object->operation_synchronizer[priority]));
+        wake_up_flow(the_object, priority);
+
+        objects[param].mirror_sources--;
+        mutex_unlock(&links_lock);
+        return 0;
+}
+
+
+/** select_shard - get the minor that a write issued on a device file has to go to. Writes on a shard leader are
+ *  spread over the members by the shard key of the session, or by the current CPU. The group is read without the
+ *  shards_lock, a write racing with a change of the group can still go to a former member.
+ *  @minor: minor number of the device file
+ *  @sess_info: io_sess_info struct of the calling session
+ *
+ *  Return: the minor number of the member, or the same minor if it does not lead a shard group
+ *  */
+static int select_shard(int minor, io_sess_info *sess_info){
+        object_state *the_object;
+        int nr_shards;
+        unsigned long key;
+
+        the_object = objects + minor;
+        nr_shards = READ_ONCE(the_object->nr_shards);
+        if(nr_shards == 0)
+            return minor;
+
+        key = sess_info->shard_key;
+        if(key == SHARD_BY_CPU)
+            key = raw_smp_processor_id();
+        return READ_ONCE(the_object->shard_members[key % nr_shards]);
+}
+
+
+/** set_shard_group - define the members of the shard group led by a device file, or dissolve it.
+ *  @minor: minor number of the leader
+ *  @param: user pointer to a shard_group_info struct
+ *
+ *  Return: 0 in case of success, -1 if a member is not valid, is repeated or belongs to another group
+ *  */
+static int set_shard_group(int minor, const void __user *param){
+        object_state *the_object;
+        shard_group_info info;
+        int i;
+        int j;
+
+        if(copy_from_user(&info, param, sizeof(shard_group_info)))
+            return -EFAULT;
+        if(info.nr_members < 0 || info.nr_members > MAX_SHARDS)
+            return -1;
+
+        the_object = objects + minor;
+        mutex_lock(&shards_lock);
+        for(i=0;i<info.nr_members;i++){
+            int member = info.members[i];
+            if(member < 0 || member >= MINORS)
+                goto shards_failure;
+            if(objects[member].shard_leader >= 0 && objects[member].shard_leader != minor)
+                goto shards_failure;
+            // the leader can be a member, but nobody else can lead a group of its own
+            if(member != minor && objects[member].nr_shards > 0)
+                goto shards_failure;
+            for(j=0;j<i;j++){
+                if(info.members[j] == member)
+                    goto shards_failure;
+            }
+        }
+        if(info.nr_members > 0 && the_object->shard_leader >= 0 && the_object->shard_leader != minor)
+            goto shards_failure;
+
+        for(i=0;i<the_object->nr_shards;i++)
+            objects[the_object->shard_members[i]].shard_leader = -1;
+        WRITE_ONCE(the_object->nr_shards, 0);
+        for(i=0;i<info.nr_members;i++){
+            the_object->shard_members[i] = info.members[i];
+            objects[info.members[i]].shard_leader = minor;
+        }
+        the_object->shard_next = 0;
+        WRITE_ONCE(the_object->nr_shards, info.nr_members);
+        mutex_unlock(&shards_lock);
+        return 0;
+
+shards_failure:
+        mutex_unlock(&shards_lock);
+#ifdef DEBUG_INFO
+        printk("%s: shard group of minor %d is not valid\n", MODNAME, minor);
+#endif
+        return -1;
+}
+
+
+/** shard_has_data - check, without locks, if a member of a shard group has data that the leader can read.
+ *  Members in fan-out mode are skipped, since reads through the leader are destructive.
+ *  @minor: minor number of the leader
+ *  @priority: data flow priority
+ *  */
+static int shard_has_data(int minor, int priority){
+        object_state *member;
+        int nr_shards;
+        int i;
+
+        nr_shards = READ_ONCE(objects[minor].nr_shards);
+        for(i=0;i<nr_shards;i++){
+            member = objects + READ_ONCE(objects[minor].shard_members[i]);
+            if(!member->fanout && member->valid_bytes[priority] > 0)
+                return 1;
+        }
+        return 0;
+}
+
+
+/** take_stream_data - destructive read of the first bytes of a flow.
+ *  Must be called with the lock of the flow held, on a device file that is not in fan-out mode.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @whole_records: 1 to read only whole records, as for the members of a consumer group
+ *  @buffer: kernel buffer where the data is copied
+ *  @len: size of the buffer
+ *
+ *  Return: the number of bytes read, or -EMSGSIZE if the next record does not fit the buffer
+ *  */
+static int take_stream_data(object_state *the_object, int priority, int whole_records, char *buffer, int len){
+        if(len > the_object->valid_bytes[priority])
+            len = the_object->valid_bytes[priority];
+        if(len > 0 && whole_records)
+            len = record_bytes(the_object, priority, the_object->stream_head[priority], len);
+        if(len <= 0)
+            return len;
+
+        read_stream_data(the_object, priority, the_object->stream_head[priority], buffer, len);
+        consume_stream_data(the_object, priority, len);
+        return len;
+}
+
+
+/** shard_read - read issued on a shard leader: the members are scanned round robin starting from the one after the
+ *  last member read, and the data of the first one that has something is returned. 
+ *  @minor: minor number of the leader
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @op: deadline of the operation
+ *  @buff: user buffer
+ *  @len: size of the user buffer
+ *
+ *  Return: the number of bytes read, 0 if no member has data, or a negative error code
+ *  */
+static ssize_t shard_read(int minor, io_sess_info *sess_info, op_deadline *op, char *buff, size_t len){
+        object_state *leader;
+        object_state *member;
+        char *temp_buffer;
+        int priority;
+        int nr_shards;
+        int start;
+        int total_len;
+        int ret;
+        int i;
+
+        leader = objects + minor;
+        priority = sess_info->priority;
+        if(len > OBJECT_MAX_SIZE*MAX_PAGES)
+            len = OBJECT_MAX_SIZE*MAX_PAGES;    // no flow can hold more than this
+        temp_buffer = (char*)kmalloc(len*sizeof(char), GFP_KERNEL);
+        if(temp_buffer == NULL)
+            return -ENOMEM;
+
+        total_len = 0;
+        while(1){
+            nr_shards = READ_ONCE(leader->nr_shards);
+            start = leader->shard_next;
+            for(i=0;i<nr_shards && total_len == 0;i++){
+                int member_minor = READ_ONCE(leader->shard_members[(start + i) % nr_shards]);
+                member = objects + member_minor;
+                if(member->fanout || member->valid_bytes[priority] == 0)
+                    continue;
+
+                mutex_lock(&(member->operation_synchronizer[priority]));
+                if(!member->fanout)
+                    total_len = take_stream_data(member, priority, sess_info->group != NULL, temp_buffer, len);
+                mutex_unlock(&(member->operation_synchronizer[priority]));
+                wake_up_flow(member, priority);
+                leader->shard_next = (start + i + 1) % nr_shards;
+            }
+
+            if(total_len != 0 || op->timeout == 0)
+                break;
+            if(try_wait_for_data(sess_info, op, minor, 0, WAIT_SHARDS) != 1)
+                break;
+        }
+
+        if(total_len <= 0){
+            kfree((void*)temp_buffer);
+            return total_len;
+        }
+        ret = copy_to_user(buff, temp_buffer, total_len);
+        kfree((void*)temp_buffer);
+        return total_len - ret;
+}
+
+
+/** multi_has_data - check, without locks, if any of the flows of a MULTI_READ has data to read.
+ *  @info: the request, already validated
+ *  */
+static int multi_has_data(multi_read_info *info){
+        object_state *the_object;
+        int i;
+
+        for(i=0;i<info->nr_sources;i++){
+            the_object = objects + info->sources[i].minor;
+            if(!the_object->fanout && the_object->valid_bytes[info->sources[i].priority] > 0)
+                return 1;
+        }
+        return 0;
+}
+
+
+/** multi_read - drain a set of flows, possibly of different minors, with a single call. The flows are read in the 
+ *  given order until the buffer is full, each one preceded by a multi_read_header. Flows in fan-out mode are skipped,
+ *  since these reads are destructive. The wait for data uses the timeout of the request, or the one of the session.
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @param: user pointer to a multi_read_info struct
+ *
+ *  Return: the number of bytes written in the user buffer (headers included), 0 if no flow had data within the 
+ *  timeout, or a negative error code
+ *  */
+static long multi_read(io_sess_info *sess_info, const void __user *param){
+        multi_read_info *info;
+        multi_read_header header;
+        object_state *the_object;
+        op_deadline op;
+        char *temp_buffer;
+        size_t len;
+        int total_len;
+        int ret;
+        int i;
+
+        info = (multi_read_info *)kmalloc(sizeof(multi_read_info), GFP_KERNEL);
+        if(info == NULL)
+            return -ENOMEM;
+        if(copy_from_user(info, param, sizeof(multi_read_info))){
+            kfree((void*)info);
+            return -EFAULT;
+        }
+        if(info->nr_sources < 0 || info->nr_sources > MAX_MULTI_SOURCES)
+            goto multi_invalid;
+        for(i=0;i<info->nr_sources;i++){
+            if(info->sources[i].minor < 0 || info->sources[i].minor >= MINORS || info->sources[i].priority < 0 || info->sources[i].priority >= NR_FLOWS)
+                goto multi_invalid;
+        }
+
+        len = info->len;
+        if(len > MAX_MULTI_READ)
+            len = MAX_MULTI_READ;
+        temp_buffer = (char*)kmalloc(len*sizeof(char), GFP_KERNEL);
+        if(temp_buffer == NULL){
+            kfree((void*)info);
+            return -ENOMEM;
+        }
+
+        start_operation(sess_info, &op);
+        if(info->timeout_ns > 0)
+            set_deadline(&op, info->timeout_ns);
+        if(!multi_has_data(info) && op.timeout > 0){
+            ret = wait_event_interruptible_hrtimeout(multi_wq_head, multi_has_data(info), ns_to_ktime(remaining_timeout(&op)));
+            if(ret == -ERESTARTSYS){
+                kfree((void*)temp_buffer);
+                kfree((void*)info);
+                return -EINTR;
+            }
+        }
+
+        total_len = 0;
+        for(i=0;i<info->nr_sources && total_len + sizeof(multi_read_header) < len;i++){
+            the_object = objects + info->sources[i].minor;
+            header.minor = info->sources[i].minor;
+            header.priority = info->sources[i].priority;
+            if(the_object->fanout || the_object->valid_bytes[header.priority] == 0)
+                continue;
+
+            mutex_lock(&(the_object->operation_synchronizer[header.priority]));
+            header.len = 0;
+            if(!the_object->fanout)
+                header.len = take_stream_data(the_object, header.priority, 0, temp_buffer + total_len + sizeof(multi_read_header), len - total_len - sizeof(multi_read_header));
+            mutex_unlock(&(the_object->operation_synchronizer[header.priority]));
+            wake_up_flow(the_object, header.priority);
+            if(header.len <= 0)
+                continue;
+
+            memcpy(temp_buffer + total_len, &header, sizeof(multi_read_header));
+            total_len += sizeof(multi_read_header) + header.len;
+        }
+
+        ret = 0;
+        if(total_len > 0)
+            ret = copy_to_user(info->buffer, temp_buffer, total_len);
+        kfree((void*)temp_buffer);
+        kfree((void*)info);
+        return total_len - ret;
+
+multi_invalid:
+        kfree((void*)info);
+        return -EINVAL;
+}
+
+
+/** init_bucket - set the rates of a token bucket, which starts full.
+ *  @bucket: the token bucket
+ *  @bytes_rate: bytes per second, 0 means no limit
+ *  @ops_rate: operations per second, 0 means no limit
+ *  */
+static void init_bucket(token_bucket *bucket, unsigned long bytes_rate, unsigned long ops_rate){
+        spin_lock_init(&(bucket->lock));
+        bucket->bytes_rate = bytes_rate;
+        bucket->ops_rate = ops_rate;
+        bucket->bytes_credit = (u64)bytes_rate*USEC_PER_SEC;
+        bucket->ops_credit = (u64)ops_rate*USEC_PER_SEC;
+        bucket->last_refill = ktime_get();
+}
+
+
+/** refill_bucket - add the credits earned since the last refill. Must be called with the lock of the bucket held.
+ *  @bucket: the token bucket
+ *  @now: current time
+ *  */
+static void refill_bucket(token_bucket *bucket, ktime_t now){
+        s64 elapsed;
+
+        elapsed = ktime_us_delta(now, bucket->last_refill);
+        if(elapsed <= 0)
+            return;
+        if(elapsed > USEC_PER_SEC)
+            elapsed = USEC_PER_SEC;     // the bucket is full after one second anyway
+
+        bucket->bytes_credit += (u64)elapsed*bucket->bytes_rate;
+        if(bucket->bytes_credit > (u64)bucket->bytes_rate*USEC_PER_SEC)
+            bucket->bytes_credit = (u64)bucket->bytes_rate*USEC_PER_SEC;
+        bucket->ops_credit += (u64)elapsed*bucket->ops_rate;
+        if(bucket->ops_credit > (u64)bucket->ops_rate*USEC_PER_SEC)
+            bucket->ops_credit = (u64)bucket->ops_rate*USEC_PER_SEC;
+        bucket->last_refill = now;
+}
+
+
+/** bucket_wait - microseconds to wait before the bucket has the credits for a write of len bytes. A write larger 
+ *  than one second of traffic only needs a full bucket. Must be called with the lock of the bucket held.
+ *  @bucket: the token bucket
+ *  @len: size of the write
+ *
+ *  Return: 0 if the write can be done now
+ *  */
+static u64 bucket_wait(token_bucket *bucket, size_t len){
+        u64 cost;
+        u64 wait;
+        u64 ops_wait;
+
+        wait = 0;
+        if(bucket->bytes_rate > 0){
+            cost = (u64)min_t(size_t, len, bucket->bytes_rate)*USEC_PER_SEC;
+            if(bucket->bytes_credit < cost)
+                wait = div64_u64(cost - bucket->bytes_credit + bucket->bytes_rate - 1, bucket->bytes_rate);
+        }
+        if(bucket->ops_rate > 0 && bucket->ops_credit < USEC_PER_SEC){
+            ops_wait = div64_u64(USEC_PER_SEC - bucket->ops_credit + bucket->ops_rate - 1, bucket->ops_rate);
+            if(ops_wait > wait)
+                wait = ops_wait;
+        }
+        return wait;
+}
+
+
+/** bucket_take - consume the credits of a write of len bytes. Must be called with the lock of the bucket held,
+ *  after bucket_wait returned 0.
+ *  @bucket: the token bucket
+ *  @len: size of the write
+ *  */
+static void bucket_take(token_bucket *bucket, size_t len){
+        if(bucket->bytes_rate > 0)
+            bucket->bytes_credit -= (u64)min_t(size_t, len, bucket->bytes_rate)*USEC_PER_SEC;
+        if(bucket->ops_rate > 0)
+            bucket->ops_credit -= USEC_PER_SEC;
+}
+
+
+/** throttle_write - apply the rate limits of the session and of the minor to a write. If the credits are not enough,
+ *  a blocking session sleeps until they are (within its timeout), while a non blocking one fails.
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @op: deadline of the operation
+ *  @minor: minor number of the device file written
+ *  @len: size of the write
+ *
+ *  Return: 0 if the write can go on, -EAGAIN if the credits are not available in time, -EINTR on a signal
+ *  */
+static int throttle_write(io_sess_info *sess_info, op_deadline *op, int minor, size_t len){
+        token_bucket *sess_bucket;
+        token_bucket *minor_bucket;
+        ktime_t delay;
+        ktime_t start;
+        u64 wait;
+        u64 minor_wait;
+        int slept;
+        int ret;
+
+        sess_bucket = &(sess_info->write_limit);
+        minor_bucket = &(objects[minor].write_limit);
+        if(sess_bucket->bytes_rate == 0 && sess_bucket->ops_rate == 0 && minor_bucket->bytes_rate == 0 && minor_bucket->ops_rate == 0)
+            return 0;
+
+        start = ktime_get();
+        slept = 0;
+        ret = 0;
+        while(1){
+            // the session bucket is always locked before the minor one
+            spin_lock(&(sess_bucket->lock));
+            spin_lock(&(minor_bucket->lock));
+            refill_bucket(sess_bucket, ktime_get());
+            refill_bucket(minor_bucket, ktime_get());
+            wait = bucket_wait(sess_bucket, len);
+            minor_wait = bucket_wait(minor_bucket, len);
+            if(minor_wait > wait)
+                wait = minor_wait;
+            if(wait == 0){
+                bucket_take(sess_bucket, len);
+                bucket_take(minor_bucket, len);
+            }
+            spin_unlock(&(minor_bucket->lock));
+            spin_unlock(&(sess_bucket->lock));
+
+            if(wait == 0)
+                break;
+            if(op->timeout == 0 || wait*NSEC_PER_USEC > remaining_timeout(op)){
+                ret = -EAGAIN;
+                break;
+            }
+#ifdef DEBUG_INFO
+            printk("%s: write throttled for %llu microseconds\n", MODNAME, wait);
+#endif
+            delay = ns_to_ktime(wait*NSEC_PER_USEC);
+            set_current_state(TASK_INTERRUPTIBLE);
+            schedule_hrtimeout(&delay, HRTIMER_MODE_REL);
+            slept = 1;
+            if(signal_pending(current)){
+                ret = -EINTR;
+                break;
+            }
+        }
+
+        // a write is counted as throttled if it was delayed or refused
+        if(slept || ret < 0)
+            throttled_bytes[minor] += len;
+        if(slept)
+            throttled_usecs[minor] += ktime_us_delta(ktime_get(), start);
+        return ret;
+}
+
+
+/** set_rate_limit - change the write rate limit of the session or of the whole minor.
+ *  @minor: minor number of the device file
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @param: user pointer to a rate_limit_info struct
+ *
+ *  Return: 0 in case of success, -1 if the scope is not valid
+ *  */
+static int set_rate_limit(int minor, io_sess_info *sess_info, const void __user *param){
+        rate_limit_info info;
+        token_bucket *bucket;
+
+        if(copy_from_user(&info, param, sizeof(rate_limit_info)))
+            return -EFAULT;
+        if(info.scope == 0)
+            bucket = &(sess_info->write_limit);
+        else if(info.scope == 1)
+            bucket = &(objects[minor].write_limit);
+        else
+            return -1;
+
+        spin_lock(&(bucket->lock));
+        bucket->bytes_rate = info.bytes_per_sec;
+        bucket->ops_rate = info.ops_per_sec;
+        bucket->bytes_credit = (u64)info.bytes_per_sec*USEC_PER_SEC;
+        bucket->ops_credit = (u64)info.ops_per_sec*USEC_PER_SEC;
+        bucket->last_refill = ktime_get();
+        spin_unlock(&(bucket->lock));
+        return 0;
+}
+
+
+/** fair_lock_ready - wait condition of the threads queued for the lock of a flow: only the thread at the head of the
+ *  FIFO tries to take the lock.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *
+ *  Return: 1 if the calling thread got the lock, 0 otherwise
+ *  */
+static int fair_lock_ready(object_state *the_object, int priority){
+        queue_elem *head;
+
+        head = READ_ONCE(the_object->lock_queue_head[priority]);
+        if(head == NULL || head->the_task != current)
+            return 0;
+        return mutex_trylock(&(the_object->operation_synchronizer[priority]));
+}
+
+
+/** wake_up_flow - wake up the threads waiting on a flow after its lock was released. The thread at the head of the
+ *  lock FIFO is woken directly, since the exclusive wake up could pick any other thread of the wait queue.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  */
+static void wake_up_flow(object_state *the_object, int priority){
+        queue_elem *head;
+
+        spin_lock(&(the_object->lock_queue_lock[priority]));
+        head = the_object->lock_queue_head[priority];
+        if(head != NULL)
+            wake_up_process(head->the_task);
+        spin_unlock(&(the_object->lock_queue_lock[priority]));
+
+        wake_up_interruptible(&(the_object->the_wq_head[priority]));    // wakes up one thread in the wait_queue of threads that are waiting for the lock
+}
+
+
+/** get_wait_stats - copy to user space the statistics of the waits of the session for the flow locks.
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @param: user pointer to a wait_stats_info struct
+ *
+ *  Return: 0 in case of success, -EFAULT otherwise
+ *  */
+static int get_wait_stats(io_sess_info *sess_info, void __user *param){
+        wait_stats_info info;
+
+        info.waits = sess_info->lock_waits;
+        info.timeouts = sess_info->lock_timeouts;
+        info.total_usecs = sess_info->lock_wait_total;
+        info.max_usecs = sess_info->lock_wait_max;
+        if(copy_to_user(param, &info, sizeof(wait_stats_info)))
+            return -EFAULT;
+        return 0;
+}
+
+
+/** promote_aged_data - move the low priority records older than the aging threshold to the tail of the high flow.
+ *  Must be called with the lock of the high flow held: the lock of the low flow is only tried, since the usual order
+ *  takes the two flows one at a time. Records are moved whole and only while they fit the free space of the high flow;
+ *  flows in fan-out mode are not touched, since their data belongs to the cursors.
+ *  @the_object: object_state of the device file
+ *
+ *  Return: number of bytes promoted
+ *  */
+static int promote_aged_data(object_state *the_object){
+        record_desc *record;
+        ktime_t limit;
+        char *buffer;
+        int minor;
+        int promoted;
+        int len;
+
+        if(the_object->fanout || READ_ONCE(the_object->lock_queue_head[0]) != NULL ||
+                !mutex_trylock(&(the_object->operation_synchronizer[0])))
+            return 0;
+
+        minor = the_object - objects;
+        promoted = 0;
+        limit = ktime_sub(ktime_get(), ms_to_ktime(the_object->age_msecs));
+        list_for_each_entry(record, &(the_object->records[0]), node){
+            if(record->end_offset <= the_object->stream_head[0])
+                continue;
+            if(ktime_after(record->stamp, limit))
+                break;
+
+            len = (int)(record->end_offset - the_object->stream_head[0]);
+            if(len > the_object->total_free_bytes[1] || the_object->spill_bytes[1] > 0)
+                break;  // the promoted records cannot pass the data spilled by the high flow
+            buffer = (char*)kmalloc(len, GFP_ATOMIC);
+            if(buffer == NULL)
+                break;
+            read_stream_data(the_object, 0, the_object->stream_head[0], buffer, len);
+            if(append_to_flow(the_object, 1, buffer, len) < 0){
+                kfree((void*)buffer);
+                break;
+            }
+            kfree((void*)buffer);
+            the_object->total_free_bytes[1] -= len;
+            /* The records behind the head are freed by trim_stream_data, so the walk restarts from the first one */
+            consume_stream_data(the_object, 0, len);
+            promoted += len;
+            record = list_entry(&(the_object->records[0]), record_desc, node);
+        }
+        mutex_unlock(&(the_object->operation_synchronizer[0]));
+        wake_up_flow(the_object, 0);    // sessions that queued meanwhile, the low flow may also have more free space
+
+        if(promoted > 0){
+            promoted_bytes[minor] += promoted;
+            wake_up_readers(the_object, 1);
+#ifdef DEBUG_INFO
+            printk("%s: promoted %d bytes of aged data on minor %d\n", MODNAME, promoted, minor);
+#endif
+        }
+        return promoted;
+}
+
+
+/** do_aging_work - periodic promotion of the aged low priority data of a minor. It runs every half threshold, until
+ *  aging is disabled.
+ *  @work: the work_struct of the aging_work of the minor
+ *  */
+static void do_aging_work(struct work_struct *work){
+        object_state *the_object;
+        unsigned long msecs;
+
+        the_object = container_of(to_delayed_work(work), object_state, aging_work);
+        mutex_lock(&(the_object->operation_synchronizer[1]));
+        if(the_object->age_msecs > 0)
+            promote_aged_data(the_object);
+        mutex_unlock(&(the_object->operation_synchronizer[1]));
+        wake_up_flow(the_object, 1);
+
+        msecs = READ_ONCE(the_object->age_msecs);
+        if(msecs > 0)
+            schedule_delayed_work(&(the_object->aging_work), msecs_to_jiffies(msecs/2) + 1);
+}
+
+
+/** set_aging - set the aging threshold of the low priority flow of a minor, 0 disables the promotion.
+ *  @minor: minor number of the device file
+ *  @msecs: age in milliseconds after which a low priority record is moved to the high flow
+ *  */
+static void set_aging(int minor, unsigned long msecs){
+        object_state *the_object;
+
+        the_object = objects + minor;
+        WRITE_ONCE(the_object->age_msecs, msecs);
+        if(msecs > 0)
+            mod_delayed_work(system_wq, &(the_object->aging_work), msecs_to_jiffies(msecs/2) + 1);
+        else
+            cancel_delayed_work_sync(&(the_object->aging_work));
+}
+
+
+/** expire_stream_data - discard the records of a flow that are older than its time to live. The readers lose them as
+ *  with the overwrite mode, so the cursors behind the new head account them as missed. Must be called with the lock
+ *  of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *
+ *  Return: number of bytes expired
+ *  */
+static int expire_stream_data(object_state *the_object, int priority){
+        record_desc *record;
+        ktime_t limit;
+        u64 new_head;
+        int minor;
+        int expired;
+
+        if(the_object->ttl_msecs[priority] == 0 || the_object->valid_bytes[priority] == 0)
+            return 0;
+
+        limit = ktime_sub(ktime_get(), ms_to_ktime(the_object->ttl_msecs[priority]));
+        new_head = the_object->stream_head[priority];
+        list_for_each_entry(record, &(the_object->records[priority]), node){
+            if(record->end_offset <= new_head)
+                continue;
+            if(ktime_after(record->stamp, limit))
+                break;
+            new_head = record->end_offset;
+        }
+        expired = (int)(new_head - the_object->stream_head[priority]);
+        if(expired == 0)
+            return 0;
+
+        minor = the_object - objects;
+        drop_stream_data(the_object, priority, expired);
+        if(priority)
+            high_expired_bytes[minor] += expired;
+        else
+            low_expired_bytes[minor] += expired;
+#ifdef DEBUG_INFO
+        printk("%s: %d bytes expired on minor %d, flow %d\n", MODNAME, expired, minor, priority);
+#endif
+        return expired;
+}
+
+
+/** do_expiry_work - background sweep of the expired records, for the flows that nobody reads or writes. Busy flows
+ *  are skipped, since their own operations expire the data. The sweep stops once no flow has a time to live.
+ *  @work: the work_struct of expiry_work
+ *  */
+static void do_expiry_work(struct work_struct *work){
+        object_state *the_object;
+        int pending;
+        int i;
+        int j;
+
+        pending = 0;
+        for(i=0;i<MINORS;i++){
+            the_object = objects + i;
+            for(j=0;j<NR_FLOWS;j++){
+                if(READ_ONCE(the_object->ttl_msecs[j]) == 0)
+                    continue;
+                pending = 1;
+                // the sweep does not pass the sessions queued for the lock, their own operation expires the records
+                if(READ_ONCE(the_object->lock_queue_head[j]) != NULL)
+                    continue;
+                if(!mutex_trylock(&(the_object->operation_synchronizer[j])))
+                    continue;
+                expire_stream_data(the_object, j);
+                mutex_unlock(&(the_object->operation_synchronizer[j]));
+                wake_up_flow(the_object, j);    // sessions that queued meanwhile, and writers waiting for free space
+            }
+        }
+        if(pending)
+            schedule_delayed_work(&expiry_work, msecs_to_jiffies(EXPIRY_SWEEP_MSECS));
+}
+
+
+/** start_operation - set the timeout of the operation that the session is starting: the one shot timeout set with
+ *  SET_NEXT_TIMEOUT_NS if any, otherwise the default one of the session. The one shot timeout is taken atomically,
+ *  so it is used by a single operation even if threads share the session. The deadline of the operation starts here.
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @op: deadline of the operation, kept by the caller
+ *  */
+static void start_operation(io_sess_info *sess_info, op_deadline *op){
+        unsigned long next;
+
+        next = xchg(&(sess_info->next_timeout_ns), NO_NEXT_TIMEOUT);
+        if(next != NO_NEXT_TIMEOUT)
+            set_deadline(op, next);
+        else
+            set_deadline(op, READ_ONCE(sess_info->timeout_ns));
+}
+
+
+/** set_deadline - start an operation with the given timeout.
+ *  @op: deadline of the operation
+ *  @timeout: timeout in nanoseconds, 0 for a non blocking operation
+ *  */
+static void set_deadline(op_deadline *op, u64 timeout){
+        ktime_t now;
+
+        op->timeout = timeout;
+        now = ktime_get();
+        if(timeout >= (u64)(KTIME_MAX - now))
+            op->deadline = KTIME_MAX;    // practically infinite, do not overflow
+        else
+            op->deadline = ktime_add_ns(now, timeout);
+}
+
+
+/** remaining_timeout - time left before the deadline of the operation in progress.
+ *  @op: deadline of the operation
+ *
+ *  Return: the remaining time in nanoseconds, 0 if the deadline has passed
+ *  */
+static u64 remaining_timeout(op_deadline *op){
+        s64 left;
+
+        left = ktime_to_ns(ktime_sub(op->deadline, ktime_get()));
+        return (left > 0) ? (u64)left : 0;
+}
+
+
+/** wait_condition - the condition a blocked operation is waiting for, as checked by do_sleep_wqe. For WAIT_MUTEX
+ *  the lock is taken only if nobody is queued for it.
+ *  @minor: minor number of the device file
+ *  @priority: data flow priority
+ *  @value: value for the condition
+ *  @event: sleep event
+ *
+ *  Return: 1 if the condition holds (for WAIT_MUTEX, the lock has been taken), 0 otherwise
+ *  */
+static int wait_condition(int minor, int priority, long long value, int event){
+        object_state *the_object;
+
+        the_object = objects + minor;
+        switch (event){
+            case WAIT_MUTEX:
+                return READ_ONCE(the_object->lock_queue_head[priority]) == NULL && mutex_trylock(&(the_object->operation_synchronizer[priority])) == 1;
+            case WAIT_WRITE:
+                return READ_ONCE(the_object->total_free_bytes[priority]) > value;
+            case WAIT_READ:
+                // pending deferred writes can be appended by the reader itself
+                return READ_ONCE(the_object->valid_bytes[priority]) > value || (priority == 0 && !list_empty(&(the_object->deferred_writes)));
+            case WAIT_CURSOR:
+                return (long long)READ_ONCE(the_object->stream_tail[priority]) > value;
+            case WAIT_SHARDS:
+                return shard_has_data(minor, priority);
+            case WAIT_HANDOFF:
+                // value is the handoff_req of the parked reader
+                return smp_load_acquire(&(((handoff_req *)(unsigned long)value)->filled)) >= 0 || READ_ONCE(the_object->valid_bytes[priority]) > 0;
+        }
+        return 0;
+}
+
+
+/** spin_wait - busy poll the wait condition for the spin budget of the session, before the operation goes to sleep.
+ *  The spin gives up early if the deadline of the operation is closer, a signal is pending or the CPU is needed.
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @op: deadline of the operation
+ *  @minor: minor number of the device file
+ *  @priority: data flow priority
+ *  @value: value for the condition
+ *  @event: sleep event
+ *
+ *  Return: 1 if the condition became true while spinning, 0 if the operation has to sleep
+ *  */
+static int spin_wait(io_sess_info *sess_info, op_deadline *op, int minor, int priority, long long value, int event){
+        ktime_t end;
+        u64 budget;
+
+        if(sess_info->spin_usecs == 0)
+            return 0;
+
+        budget = (u64)sess_info->spin_usecs*NSEC_PER_USEC;
+        if(budget > remaining_timeout(op))
+            budget = remaining_timeout(op);
+        end = ktime_add_ns(ktime_get(), budget);
+        while(1){
+            if(wait_condition(minor, priority, value, event)){
+                spin_success[minor] += 1;
+                return 1;
+            }
+            if(ktime_after(ktime_get(), end) || need_resched() || signal_pending(current))
+                break;
+            cpu_relax();
+        }
+        spin_fallback[minor] += 1;
+        return 0;
+}
+
+
+/** handoff_allowed - check if the data of the high flow can skip the pages: nobody but the reader that gets it
+ *  could ever read it, so there are no cursors, consumer groups or retention window.
+ *  @the_object: object_state of the device file
+ *
+ *  Return: 1 if a direct handoff is allowed, 0 otherwise
+ *  */
+static int handoff_allowed(object_state *the_object){
+        return !the_object->fanout && list_empty(&(the_object->cursors[1])) && the_object->retain_bytes[1] == 0 && the_object->retain_msecs[1] == 0 && list_empty(&(the_object->groups));
+}
+
+
+/** handoff_write - copy a high priority write directly in the buffer of the first parked reader, if the flow is empty
+ *  and the write fits the buffer. The data moves the stream offsets as if it was written and read at once. An empty
+ *  write is never handed off, the reader would see it as the end of the stream. Must be called with the lock of the
+ *  high flow held.
+ *  @the_object: object_state of the device file
+ *  @buffer: kernel buffer with the data of the write
+ *  @len: size of the write
+ *
+ *  Return: the number of bytes handed off, 0 if the write has to go through the flow
+ *  */
+static int handoff_write(object_state *the_object, char *buffer, size_t len){
+        struct task_struct *task;
+        handoff_req *req;
+        int minor;
+
+        if(len == 0 || the_object->valid_bytes[1] != 0 || list_empty(&(the_object->handoff_reqs)) ||
+                !handoff_allowed(the_object))
+            return 0;
+
+        spin_lock(&(the_object->handoff_lock));
+        req = list_first_entry_or_null(&(the_object->handoff_reqs), handoff_req, node);
+        if(req == NULL || req->len < len){
+            spin_unlock(&(the_object->handoff_lock));
+            return 0;
+        }
+        list_del_init(&(req->node));
+        spin_unlock(&(the_object->handoff_lock));
+
+        /* The flow stays empty: the consumed pages are released and the offsets jump past the data */
+        release_flow_pages(the_object, 1);
+        the_object->stream_tail[1] += len;
+        the_object->stream_head[1] += len;
+        the_object->retain_head[1] = the_object->stream_head[1];
+        the_object->chain_base[1] = the_object->stream_tail[1];
+
+        minor = the_object - objects;
+        handoff_bytes[minor] += len;
+
+        memcpy(req->buffer, buffer, len);
+        task = req->task;
+        get_task_struct(task);
+        smp_store_release(&(req->filled), (int)len);    // from now on the reader owns the request again
+        wake_up_process(task);
+        put_task_struct(task);
+        return len;
+}
+
+
+/** release_flow_pages - free the pages and the records of a flow that has no valid data left. The next write
+ *  allocates the first page again. Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  */
+static void release_flow_pages(object_state *the_object, int priority){
+        object_content *obj_index;
+        record_desc *record;
+
+        obj_index = the_object->list_heads[priority]->next;
+        while(obj_index != NULL){
+            object_content *temp = obj_index;
+            obj_index = obj_index->next;
+            free_page((unsigned long)temp->stream_content);
+            kfree((void*)temp);
+        }
+        the_object->list_heads[priority]->next = NULL;
+
+        while(!list_empty(&(the_object->records[priority]))){
+            record = list_first_entry(&(the_object->records[priority]), record_desc, node);
+            list_del(&(record->node));
+            kfree((void*)record);
+        }
+}
+
+
+/** run_deferred_write - append the data of a deferred write to the low flow and release its buffer. The packed_data_wq
+ *  itself is freed by its work, or here if the write was batched. Must be called with the lock of the low flow held.
+ *  @the_object: object_state of the device file
+ *  @the_wq: the deferred write
+ *  */
+static void run_deferred_write(object_state *the_object, packed_data_wq *the_wq){
+        int ret;
+
+        ret = append_to_flow(the_object, 0, the_wq->data, the_wq->len);
+        if(ret < 0)
+            give_back_free_bytes(the_object, 0, the_wq->len);  // the space reserved by dev_write
+        else
+            mirror_write(the_object, 0, the_wq->data, the_wq->len);
+        finish_deferred_write(the_object, the_wq, ret);
+}
+
+
+/** cancel_deferred_write - drop a deferred write that was not appended, giving back the space reserved by dev_write.
+ *  Must be called with the lock of the low flow held.
+ *  @the_object: object_state of the device file
+ *  @the_wq: the deferred write
+ *  */
+static void cancel_deferred_write(object_state *the_object, packed_data_wq *the_wq){
+        give_back_free_bytes(the_object, 0, the_wq->len);
+        low_cancelled_bytes[the_object - objects] += the_wq->len;
+        finish_deferred_write(the_object, the_wq, -ECANCELED);
+}
+
+
+/** finish_deferred_write - post the completion of a deferred write that was appended or dropped, and take it off the
+ *  pending list of the minor. Must be called with the lock of the low flow held.
+ *  @the_object: object_state of the device file
+ *  @the_wq: the deferred write
+ *  @ret: bytes appended, or a negative error
+ *  */
+static void finish_deferred_write(object_state *the_object, packed_data_wq *the_wq, int ret){
+        if(the_wq->ring != NULL){
+            post_completion(the_wq->ring, the_wq->seq, (ret < 0) ? 0 : ret, (ret < 0) ? ret : 0);
+            kref_put(&(the_wq->ring->refs), free_completion_ring);
+            the_wq->ring = NULL;
+        }
+
+        list_del(&(the_wq->node));
+        the_object->deferred_bytes -= the_wq->len;
+        the_wq->done = 1;
+        if(the_wq->seq > low_applied_seq[the_object - objects])
+            low_applied_seq[the_object - objects] = the_wq->seq;
+        kfree((void*)the_wq->data);
+        the_wq->data = NULL;
+
+        // a batched write has no work that would release it
+        if(!the_wq->has_work){
+            kfree((void*)the_wq);
+            module_put(THIS_MODULE);
+        }
+}
+
+
+/** drain_deferred_writes - append, in submission order, the deferred writes of the minor that the work queue has not
+ *  run yet, so that a reader of the low flow does not wait for them. Must be called with the lock of the low flow held.
+ *  @the_object: object_state of the device file
+ *
+ *  Return: number of bytes appended
+ *  */
+static int drain_deferred_writes(object_state *the_object){
+        packed_data_wq *the_wq;
+        int minor;
+        int drained;
+
+        drained = 0;
+        while(!list_empty(&(the_object->deferred_writes))){
+            the_wq = list_first_entry(&(the_object->deferred_writes), packed_data_wq, node);
+            drained += the_wq->len;
+            run_deferred_write(the_object, the_wq);
+        }
+        if(drained > 0){
+            minor = the_object - objects;
+            low_inline_bytes[minor] += drained;
+            wake_up_readers(the_object, 0);
+        }
+        return drained;
+}
+
+
+/** sync_deferred_writes - barrier for the deferred writes: the pending writes of the session, or of the whole minor,
+ *  are appended to the low flow in submission order before returning. A session without a timeout waits for the lock
+ *  as long as needed, since a barrier cannot be skipped.
+ *  @minor: minor number of the device file
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @op: deadline of the operation
+ *  @whole_minor: if set, all the pending writes of the minor are appended, not only the ones of the session
+ *  @nowait: if set, a session without a timeout only tries the lock
+ *
+ *  Return: 0 in case of success, -ETIMEDOUT if the lock of the low flow was not available in time, -EINTR on a signal
+ *  */
+static int sync_deferred_writes(int minor, io_sess_info *sess_info, op_deadline *op, int whole_minor, int nowait){
+        object_state *the_object;
+        packed_data_wq *the_wq;
+        int drained;
+
+        the_object = objects + minor;
+        if(op->timeout > 0 || nowait){
+            if(try_get_flow_lock(sess_info, op, minor, 0, "sync") != 1)
+                return -ETIMEDOUT;
+        }
+        else if(mutex_lock_interruptible(&(the_object->operation_synchronizer[0])))
+            return -EINTR;
+
+        drained = 0;
+        while(!list_empty(&(the_object->deferred_writes))){
+            the_wq = list_first_entry(&(the_object->deferred_writes), packed_data_wq, node);
+            if(!whole_minor && the_wq->seq > sess_info->last_seq)
+                break;
+            drained += the_wq->len;
+            run_deferred_write(the_object, the_wq);
+        }
+        if(drained > 0)
+            low_inline_bytes[minor] += drained;
+
+        mutex_unlock(&(the_object->operation_synchronizer[0]));
+        if(drained > 0)
+            wake_up_readers(the_object, 0);
+        wake_up_flow(the_object, 0);
+        return 0;
+}
+
+
+/** dev_fsync - wait until the deferred writes of the session are in the stream.
+ *  */
+static int dev_fsync(struct file *filp, loff_t start, loff_t end, int datasync){
+        io_sess_info *sess_info;
+        op_deadline op;
+
+        sess_info = (io_sess_info *)(filp->private_data);
+        start_operation(sess_info, &op);
+        return sync_deferred_writes(get_minor(filp), sess_info, &op, 0, 0);
+}
+
+
+/** dev_flush - called on each close of a file descriptor of the session, the deferred writes of the session are
+ *  appended before the descriptor goes away if the lock of the low flow can be had within the timeout of the session
+ *  (a non blocking session only tries it). Otherwise their work appends them later, so close never fails for them.
+ *  */
+static int dev_flush(struct file *filp, fl_owner_t id){
+        io_sess_info *sess_info;
+        op_deadline op;
+        int minor;
+
+        sess_info = (io_sess_info *)(filp->private_data);
+        if(sess_info == NULL)
+            return 0;
+        // nothing to wait for if the session made no deferred write, or the last one is already in the stream
+        minor = get_minor(filp);
+        if(sess_info->last_seq == 0 || sess_info->last_seq <= READ_ONCE(low_applied_seq[minor]))
+            return 0;
+        start_operation(sess_info, &op);
+        sync_deferred_writes(minor, sess_info, &op, 0, 1);
+        return 0;
+}
+
+
+/** do_batch_work - append all the deferred writes of a minor that are waiting for the batching window.
+ *  @work: the work_struct of the batch_work of the minor
+ *  */
+static void do_batch_work(struct work_struct *work){
+        object_state *the_object;
+        packed_data_wq *the_wq;
+        unsigned long batched;
+        int minor;
+
+        the_object = container_of(to_delayed_work(work), object_state, batch_work);
+        minor = the_object - objects;
+
+        mutex_lock(&(the_object->operation_synchronizer[0]));
+        batched = 0;
+        while(!list_empty(&(the_object->deferred_writes))){
+            the_wq = list_first_entry(&(the_object->deferred_writes), packed_data_wq, node);
+            batched += the_wq->len;
+            run_deferred_write(the_object, the_wq);
+        }
+        if(batched > 0){
+            low_batches[minor] += 1;
+            low_batched_bytes[minor] += batched;
+            if(batched > low_batch_max[minor])
+                low_batch_max[minor] = batched;
+        }
+        mutex_unlock(&(the_object->operation_synchronizer[0]));
+
+        if(batched > 0)
+            wake_up_readers(the_object, 0);
+        wake_up_flow(the_object, 0);    // the batch could have been appended already, the lock is released anyway
+#ifdef DEBUG_INFO
+        printk("%s: batch of %lu bytes appended on minor %d\n", MODNAME, batched, minor);
+#endif
+}
+
+
+/** arm_batch - start the batching window of a minor when the first write of a batch arrives, or close it right away if
+ *  the batch already holds batch_bytes. Must be called with the lock of the low flow held.
+ *  @the_object: object_state of the device file
+ *  @minor: minor number of the device file
+ *  */
+static void arm_batch(object_state *the_object, int minor){
+        if(batch_bytes[minor] > 0 && the_object->deferred_bytes >= batch_bytes[minor])
+            mod_delayed_work(system_wq, &(the_object->batch_work), 0);
+        else
+            schedule_delayed_work(&(the_object->batch_work), usecs_to_jiffies(batch_usecs[minor]));  // no-op if already armed
+}
+
+
+/** set_batch - set the batching window of the deferred writes of a minor. Disabling it appends the pending batch.
+ *  @minor: minor number of the device file
+ *  @param: user pointer to a batch_info struct
+ *
+ *  Return: 0 in case of success, -EFAULT otherwise
+ *  */
+static int set_batch(int minor, const void __user *param){
+        batch_info info;
+
+        if(copy_from_user(&info, param, sizeof(batch_info)))
+            return -EFAULT;
+        batch_usecs[minor] = info.usecs;
+        batch_bytes[minor] = info.bytes;
+        if(info.usecs == 0)
+            mod_delayed_work(system_wq, &(objects[minor].batch_work), 0);
+        return 0;
+}
+
+
+/** deferred_worker - body of the dedicated thread of a minor: it sleeps until there are deferred writes and appends
+ *  them in submission order. Before exiting it appends the ones still pending, so none is left without a worker.
+ *  @data: object_state of the minor
+ *  */
+static int deferred_worker(void *data){
+        object_state *the_object;
+        packed_data_wq *the_wq;
+        unsigned long drained;
+        int minor;
+        int stop;
+
+        the_object = (object_state *)data;
+        minor = the_object - objects;
+        do{
+            set_current_state(TASK_INTERRUPTIBLE);
+            stop = kthread_should_stop();
+            if(!stop && list_empty(&(the_object->deferred_writes))){
+                schedule();
+                continue;
+            }
+            __set_current_state(TASK_RUNNING);
+
+            mutex_lock(&(the_object->operation_synchronizer[0]));
+            drained = 0;
+            while(!list_empty(&(the_object->deferred_writes))){
+                the_wq = list_first_entry(&(the_object->deferred_writes), packed_data_wq, node);
+                drained += the_wq->len;
+                run_deferred_write(the_object, the_wq);
+            }
+            low_worker_bytes[minor] += drained;
+            mutex_unlock(&(the_object->operation_synchronizer[0]));
+            if(drained > 0)
+                wake_up_readers(the_object, 0);
+            wake_up_flow(the_object, 0);
+        } while(!stop);
+        return 0;
+}
+
+
+/** stop_worker - stop the dedicated thread of a minor, the next deferred writes go back to the work queue.
+ *  @the_object: object_state of the device file
+ *  */
+static void stop_worker(object_state *the_object){
+        struct task_struct *worker;
+
+        mutex_lock(&(the_object->operation_synchronizer[0]));
+        worker = the_object->worker;
+        the_object->worker = NULL;
+        mutex_unlock(&(the_object->operation_synchronizer[0]));
+        wake_up_flow(the_object, 0);
+        if(worker != NULL){
+            kthread_stop(worker);
+            put_task_struct(worker);
+        }
+}
+
+
+/** set_worker - start, configure or stop the dedicated thread of the deferred writes of a minor.
+ *  @minor: minor number of the device file
+ *  @param: user pointer to a worker_info struct
+ *
+ *  Return: 0 in case of success, -EPERM for SCHED_FIFO or a negative nice level without CAP_SYS_NICE, a negative
+ *  error otherwise
+ *  */
+static int set_worker(int minor, const void __user *param){
+        object_state *the_object;
+        struct task_struct *worker;
+        struct task_struct *old;
+        worker_info info;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+        struct sched_param sched;
+#endif
+
+        if(copy_from_user(&info, param, sizeof(worker_info)))
+            return -EFAULT;
+        the_object = objects + minor;
+        if(!info.enable){
+            stop_worker(the_object);
+            return 0;
+        }
+        if((info.policy != SCHED_NORMAL && info.policy != SCHED_FIFO) || info.nice < -20 || info.nice > 19)
+            return -EINVAL;
+        if(info.cpu >= 0 && (info.cpu >= nr_cpu_ids || !cpu_online(info.cpu)))
+            return -EINVAL;
+        // a real time or higher priority kernel thread needs the same privilege as for a user thread
+        if((info.policy == SCHED_FIFO || info.nice < 0) && !capable(CAP_SYS_NICE))
+            return -EPERM;
+
+        worker = kthread_create(deferred_worker, the_object, "multistream/%d", minor);
+        if(IS_ERR(worker))
+            return PTR_ERR(worker);
+        get_task_struct(worker);    // kept until kthread_stop
+
+        if(info.cpu >= 0)
+            kthread_bind(worker, info.cpu);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+        if(info.policy == SCHED_FIFO)
+            sched_set_fifo(worker);
+        else
+            sched_set_normal(worker, info.nice);
+#else
+        sched.sched_priority = (info.policy == SCHED_FIFO) ? MAX_RT_PRIO/2 : 0;
+        sched_setscheduler_nocheck(worker, info.policy, &sched);
+        if(info.policy == SCHED_NORMAL)
+            set_user_nice(worker, info.nice);
+#endif
+
+        /* The settings are changed by starting a new thread. It replaces the old one under the lock, so that concurrent
+         * calls each stop the thread they replaced, and the old one leaves no write behind */
+        mutex_lock(&(the_object->operation_synchronizer[0]));
+        old = the_object->worker;
+        the_object->worker = worker;
+        mutex_unlock(&(the_object->operation_synchronizer[0]));
+        wake_up_flow(the_object, 0);
+        wake_up_process(worker);
+        if(old != NULL){
+            kthread_stop(old);
+            put_task_struct(old);
+        }
+        return 0;
+}
+
+
+/** set_open_close - enable or disable a minor. A minor is disabled only after its pending deferred writes are appended
+ *  (CLOSE_DRAIN) or dropped (CLOSE_CANCEL), under the lock of the low flow, so that no write is still queued once the
+ *  call returns. Works or threads that later run for the dropped writes find them done.
+ *  @minor: minor number of the device file
+ *  @param: one of openclose_ops
+ *
+ *  Return: the bytes appended or dropped, -EINVAL for an unknown parameter, -EINTR on a signal
+ *  */
+static long set_open_close(int minor, unsigned long param){
+        object_state *the_object;
+        packed_data_wq *the_wq;
+        long handled;
+
+        if(param != OPEN_ENABLE && param != CLOSE_DRAIN && param != CLOSE_CANCEL)
+            return -EINVAL;
+        the_object = objects + minor;
+        if(mutex_lock_interruptible(&(the_object->operation_synchronizer[0])))
+            return -EINTR;
+
+        enable_disable_array[minor] = (param != OPEN_ENABLE); // enables or disables the device file
+        handled = 0;
+        while(param != OPEN_ENABLE && !list_empty(&(the_object->deferred_writes))){
+            the_wq = list_first_entry(&(the_object->deferred_writes), packed_data_wq, node);
+            handled += the_wq->len;
+            if(param == CLOSE_CANCEL)
+                cancel_deferred_write(the_object, the_wq);
+            else
+                run_deferred_write(the_object, the_wq);
+        }
+        if(param == CLOSE_DRAIN)
+            low_inline_bytes[minor] += handled;
+        else if(param == CLOSE_CANCEL)
+            the_object->submit_tail = the_object->stream_tail[0];   // the dropped writes will never get their offsets
+
+        mutex_unlock(&(the_object->operation_synchronizer[0]));
+        if(handled > 0)
+            wake_up_readers(the_object, 0);
+        wake_up_flow(the_object, 0);
+#ifdef DEBUG_INFO
+        printk("%s: minor %d set to %lu, %ld deferred bytes handled\n", MODNAME, minor, param, handled);
+#endif
+        return handled;
+}
+
+
+/** residual_bytes - collect the bytes left in the flows of all the minors into high_residual_bytes and
+ *  low_residual_bytes. The counters are read without the locks, so the result is a snapshot.
+ *  @busy_minors: set to the number of minors with residual bytes
+ *
+ *  Return: the bytes left in all the flows
+ *  */
+static unsigned long residual_bytes(int *busy_minors){
+        unsigned long total;
+        int i;
+
+        total = 0;
+        *busy_minors = 0;
+        for(i=0;i<MINORS;i++){
+            high_residual_bytes[i] = READ_ONCE(objects[i].valid_bytes[1]) + READ_ONCE(objects[i].spill_bytes[1]);
+            low_residual_bytes[i] = READ_ONCE(objects[i].valid_bytes[0]) + READ_ONCE(objects[i].deferred_bytes) +
+                READ_ONCE(objects[i].spill_bytes[0]);
+            if(high_residual_bytes[i] + low_residual_bytes[i] > 0){
+                total += high_residual_bytes[i] + low_residual_bytes[i];
+                *busy_minors += 1;
+            }
+        }
+        return total;
+}
+
+
+/** quiesce_device - stop accepting writes on all the minors, append the pending deferred writes and wait for the
+ *  readers to empty the flows, or accept writes again. Reads keep working while the device is quiesced.
+ *  @param: user pointer to a quiesce_info struct, on return it holds the residual bytes
+ *
+ *  Return: 0 in case of success, -EPERM without CAP_SYS_ADMIN, -EFAULT or -EINTR otherwise
+ *  */
+static long quiesce_device(void __user *param){
+        quiesce_info info;
+        object_state *the_object;
+        unsigned long deadline;
+        int busy;
+        int i;
+
+        // it acts on all the minors, not only on the one of the caller
+        if(!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if(copy_from_user(&info, param, sizeof(quiesce_info)))
+            return -EFAULT;
+        if(!info.enable){
+            WRITE_ONCE(quiesced, 0);
+            return 0;
+        }
+        WRITE_ONCE(quiesced, 1);
+
+        /* A write checks the flag with the lock of its flow held: once both the locks of a minor were taken here, every
+         * write that got in before the flag is in the flow or in the deferred list, and the list is emptied now */
+        for(i=0;i<MINORS;i++){
+            the_object = objects + i;
+            if(mutex_lock_interruptible(&(the_object->operation_synchronizer[0])))
+                return -EINTR;
+            drain_deferred_writes(the_object);
+            mutex_unlock(&(the_object->operation_synchronizer[0]));
+            wake_up_flow(the_object, 0);
+
+            if(mutex_lock_interruptible(&(the_object->operation_synchronizer[1])))
+                return -EINTR;
+            mutex_unlock(&(the_object->operation_synchronizer[1]));
+            wake_up_flow(the_object, 1);
+        }
+
+        deadline = jiffies + msecs_to_jiffies(info.msecs);
+        while(residual_bytes(&busy) > 0 && time_before(jiffies, deadline)){
+            if(msleep_interruptible(QUIESCE_POLL_MSECS))
+                break;  // a signal, the residual bytes are reported anyway
+        }
+
+        info.residual = residual_bytes(&busy);
+        info.busy_minors = busy;
+#ifdef DEV_INFO
+        printk(KERN_INFO "%s: device quiesced, %lu bytes left in %d minors\n", MODNAME, info.residual, busy);
+#endif
+        if(copy_to_user(param, &info, sizeof(quiesce_info)))
+            return -EFAULT;
+        return 0;
+}
+
+
+/** export_flow - copy the record lengths and the data held by a flow into the image of a minor.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @entry: image_minor of the device file, its records and bytes of the flow are set
+ *  @buffer: where the record lengths and the data are copied
+ *
+ *  Return: number of bytes used in buffer
+ *  */
+static int export_flow(object_state *the_object, int priority, image_minor *entry, char *buffer){
+        record_desc *record;
+        unsigned int length;
+        u64 start;
+        u64 tail;
+        int nr;
+
+        start = the_object->stream_head[priority];
+        tail = start + the_object->valid_bytes[priority];
+        nr = 0;
+        list_for_each_entry(record, &(the_object->records[priority]), node){
+            if(record->end_offset <= start)
+                continue;
+            if(record->end_offset > tail)
+                break;
+            length = record->end_offset - start;
+            memcpy(buffer + nr*sizeof(unsigned int), &length, sizeof(unsigned int));
+            nr++;
+            start = record->end_offset;
+        }
+        // the data after the last descriptor is a single record
+        if(start < tail){
+            length = tail - start;
+            memcpy(buffer + nr*sizeof(unsigned int), &length, sizeof(unsigned int));
+            nr++;
+        }
+
+        entry->records[priority] = nr;
+        entry->bytes[priority] = the_object->valid_bytes[priority];
+        read_stream_data(the_object, priority, the_object->stream_head[priority], buffer + nr*sizeof(unsigned int),
+                the_object->valid_bytes[priority]);
+        return nr*sizeof(unsigned int) + the_object->valid_bytes[priority];
+}
+
+
+/** export_minor - build the image of a minor. The pending deferred writes are appended first, so they are part of it.
+ *  The flows are locked one at a time. A flow with spilled data cannot be exported, the image would lose it.
+ *  @minor: minor number of the device file
+ *  @chunk: buffer of IMAGE_CHUNK_MAX bytes
+ *
+ *  Return: size of the image, 0 if the minor has neither data nor settings to keep, -EBUSY if a spill file holds
+ *  data, -EINTR on a signal
+ *  */
+static int export_minor(int minor, char *chunk){
+        object_state *the_object;
+        image_minor *entry;
+        int pos;
+        int j;
+
+        the_object = objects + minor;
+        entry = (image_minor *)chunk;
+        memset(entry, 0, sizeof(image_minor));
+        entry->minor = minor;
+        entry->age_msecs = READ_ONCE(the_object->age_msecs);
+        pos = sizeof(image_minor);
+        for(j=0;j<NR_FLOWS;j++){
+            if(mutex_lock_interruptible(&(the_object->operation_synchronizer[j])))
+                return -EINTR;
+            if(j == 0){
+                drain_deferred_writes(the_object);
+                entry->disabled = (enable_disable_array[minor] != 0);
+            }
+            if(the_object->spill_bytes[j] > 0){
+                mutex_unlock(&(the_object->operation_synchronizer[j]));
+                wake_up_flow(the_object, j);
+                return -EBUSY;
+            }
+            entry->overwrite = the_object->overwrite;
+            entry->ttl_msecs[j] = the_object->ttl_msecs[j];
+            pos += export_flow(the_object, j, entry, chunk + pos);
+            mutex_unlock(&(the_object->operation_synchronizer[j]));
+            wake_up_flow(the_object, j);
+        }
+
+        if(pos == sizeof(image_minor) && !entry->disabled && !entry->overwrite && entry->age_msecs == 0 &&
+                entry->ttl_msecs[0] == 0 && entry->ttl_msecs[1] == 0)
+            return 0;
+        return pos;
+}
+
+
+/** export_image - copy the image of all the minors to a user buffer. If the buffer is too small nothing but the needed
+ *  size is returned, in used.
+ *  @param: user pointer to an image_info struct
+ *
+ *  Return: 0 in case of success, -ENOSPC if the buffer is too small, -EBUSY while a spill file holds data, -EPERM
+ *  without CAP_SYS_ADMIN, -EFAULT, -ENOMEM or -EINTR otherwise
+ *  */
+static long export_image(void __user *param){
+        image_info info;
+        image_header header;
+        char *chunk;
+        unsigned long used;
+        long ret;
+        int len;
+        int i;
+
+        // the image holds the data of all the minors
+        if(!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if(copy_from_user(&info, param, sizeof(image_info)))
+            return -EFAULT;
+        chunk = vmalloc(IMAGE_CHUNK_MAX);
+        if(chunk == NULL)
+            return -ENOMEM;
+
+        header.magic = IMAGE_MAGIC;
+        header.version = IMAGE_VERSION;
+        header.minors = 0;
+        header.reserved = 0;
+        used = sizeof(image_header);
+        for(i=0;i<MINORS;i++){
+            len = export_minor(i, chunk);
+            if(len < 0){
+                ret = len;
+                goto export_out;
+            }
+            if(len == 0)
+                continue;
+            // once the buffer is full the rest of the image is only measured
+            if(used + len <= info.len && copy_to_user((char __user *)info.buffer + used, chunk, len)){
+                ret = -EFAULT;
+                goto export_out;
+            }
+            used += len;
+            header.minors++;
+        }
+
+        ret = (used <= info.len) ? 0 : -ENOSPC;
+        if(ret == 0 && copy_to_user(info.buffer, &header, sizeof(image_header)))
+            ret = -EFAULT;
+        info.used = used;
+        if(copy_to_user(param, &info, sizeof(image_info)))
+            ret = -EFAULT;
+#ifdef DEV_INFO
+        printk(KERN_INFO "%s: image of %u minors exported, %lu bytes\n", MODNAME, header.minors, used);
+#endif
+
+export_out:
+        vfree(chunk);
+        return ret;
+}
+
+
+/** import_minor - append the data of the image of a minor to its flows, record by record, and restore its settings.
+ *  The records that do not fit the flows are dropped and counted in import_dropped_bytes.
+ *  @entry: image_minor of the device file, already checked
+ *  @chunk: the record lengths and data that follow entry in the image
+ *
+ *  Return: bytes appended, -EINVAL if the record lengths do not match the data, -EINTR on a signal
+ *  */
+static int import_minor(image_minor *entry, char *chunk){
+        object_state *the_object;
+        unsigned int length;
+        unsigned long total;
+        unsigned long dropped;
+        int imported;
+        int appended;
+        int minor;
+        char *data;
+        int j;
+        int k;
+
+        // the lengths must cover exactly the data, before anything is appended
+        data = chunk;
+        for(j=0;j<NR_FLOWS;j++){
+            total = 0;
+            for(k=0;k<entry->records[j];k++){
+                memcpy(&length, data + k*sizeof(unsigned int), sizeof(unsigned int));
+                total += length;
+            }
+            if(total != entry->bytes[j])
+                return -EINVAL;
+            data += entry->records[j]*sizeof(unsigned int) + entry->bytes[j];
+        }
+
+        minor = entry->minor;
+        the_object = objects + minor;
+        set_aging(minor, entry->age_msecs);
+        imported = 0;
+        dropped = 0;
+        data = chunk;
+        for(j=0;j<NR_FLOWS;j++){
+            char *records;
+
+            records = data;
+            data += entry->records[j]*sizeof(unsigned int);
+            if(mutex_lock_interruptible(&(the_object->operation_synchronizer[j])))
+                return -EINTR;
+            if(j == 0){
+                drain_deferred_writes(the_object);  // the imported data goes after the writes already accepted
+                enable_disable_array[minor] = entry->disabled;
+            }
+            the_object->overwrite = entry->overwrite;
+            the_object->ttl_msecs[j] = entry->ttl_msecs[j];
+
+            appended = 0;
+            for(k=0;k<entry->records[j];k++){
+                memcpy(&length, records + k*sizeof(unsigned int), sizeof(unsigned int));
+                if(length > the_object->total_free_bytes[j] || append_to_flow(the_object, j, data, length) < 0)
+                    dropped += length;
+                else{
+                    the_object->total_free_bytes[j] -= length;
+                    appended += length;
+                }
+                data += length;
+            }
+            if(j == 0)
+                the_object->submit_tail = the_object->stream_tail[0];
+            mutex_unlock(&(the_object->operation_synchronizer[j]));
+            if(appended > 0)
+                wake_up_readers(the_object, j);
+            wake_up_flow(the_object, j);
+            // as SET_TTL does, the background sweep covers the flow even if nobody reads or writes it
+            if(entry->ttl_msecs[j] > 0)
+                schedule_delayed_work(&expiry_work, msecs_to_jiffies(EXPIRY_SWEEP_MSECS));
+            imported += appended;
+        }
+        import_dropped_bytes[minor] += dropped;
+        return imported;
+}
+
+
+/** import_image - append the data of an image made by EXPORT_IMAGE to the flows of the minors and restore their
+ *  settings. The minors are restored one at a time, an invalid entry stops the import.
+ *  @param: user pointer to an image_info struct, on return used holds the bytes appended
+ *
+ *  Return: 0 in case of success, -EINVAL for a malformed image, -EPERM without CAP_SYS_ADMIN, -EFAULT, -ENOMEM or
+ *  -EINTR otherwise
+ *  */
+static long import_image(void __user *param){
+        image_info info;
+        image_header header;
+        image_minor entry;
+        unsigned long pos;
+        unsigned long body;
+        char *chunk;
+        long ret;
+        int i;
+        int j;
+
+        // the image writes to all the minors
+        if(!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if(copy_from_user(&info, param, sizeof(image_info)))
+            return -EFAULT;
+        if(info.len < sizeof(image_header))
+            return -EINVAL;
+        if(copy_from_user(&header, info.buffer, sizeof(image_header)))
+            return -EFAULT;
+        if(header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION)
+            return -EINVAL;
+        chunk = vmalloc(IMAGE_CHUNK_MAX);
+        if(chunk == NULL)
+            return -ENOMEM;
+
+        info.used = 0;
+        pos = sizeof(image_header);
+        for(i=0;i<header.minors;i++){
+            if(pos + sizeof(image_minor) > info.len){
+                ret = -EINVAL;
+                goto import_out;
+            }
+            if(copy_from_user(&entry, (char __user *)info.buffer + pos, sizeof(image_minor))){
+                ret = -EFAULT;
+                goto import_out;
+            }
+            if(entry.minor >= MINORS){
+                ret = -EINVAL;
+                goto import_out;
+            }
+            body = 0;
+            for(j=0;j<NR_FLOWS;j++){
+                if(entry.bytes[j] > FLOW_MAX_BYTES || entry.records[j] > entry.bytes[j]){
+                    ret = -EINVAL;
+                    goto import_out;
+                }
+                body += entry.records[j]*sizeof(unsigned int) + entry.bytes[j];
+            }
+            pos += sizeof(image_minor);
+            if(pos + body > info.len){
+                ret = -EINVAL;
+                goto import_out;
+            }
+            if(copy_from_user(chunk, (char __user *)info.buffer + pos, body)){
+                ret = -EFAULT;
+                goto import_out;
+            }
+            ret = import_minor(&entry, chunk);
+            if(ret < 0)
+                goto import_out;
+            info.used += ret;
+            pos += body;
+        }
+        ret = 0;
+#ifdef DEV_INFO
+        printk(KERN_INFO "%s: image of %u minors imported, %lu bytes\n", MODNAME, header.minors, info.used);
+#endif
+
+import_out:
+        if(copy_to_user(param, &info, sizeof(image_info)))
+            ret = -EFAULT;
+        vfree(chunk);
+        return ret;
+}
+
+
+/** spill_needed - tell if a write has to go to the spill file of the flow: the data does not fit the memory of the
+ *  flow, or older data is still in the file. Overwrite mode makes room by itself, so it never spills.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @len: bytes of the write
+ *
+ *  Return: 1 if the write goes to the spill file, 0 otherwise
+ *  */
+static int spill_needed(object_state *the_object, int priority, size_t len){
+        if(the_object->spill_file[priority] == NULL || the_object->overwrite)
+            return 0;
+        return the_object->spill_bytes[priority] > 0 || len > the_object->total_free_bytes[priority];
+}
+
+
+/** spill_write - append a record to the spill file of the flow, as its length followed by its data. The file goes
+ *  through the page cache, so the write to the storage is done later by the kernel. A low priority write of a session
+ *  takes its sequence number here, and is acknowledged when the record is read back into the flow.
+ *  Must be called with the lock of the flow held, and the lock stays held across the file write: the readers and the
+ *  writers of the flow wait for it, dirty page throttling included.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @sess_info: io_sess_info struct of the writing session, NULL for a mirrored record
+ *  @buffer: kernel buffer with the data
+ *  @len: number of bytes to spill, at most FLOW_MAX_BYTES
+ *
+ *  Return: the number of bytes spilled, -ENOSPC if the file is at its limit, -ENOMEM or -EIO otherwise
+ *  */
+static int spill_write(object_state *the_object, int priority, io_sess_info *sess_info, char *buffer, size_t len){
+        unsigned int length;
+        spill_ack *ack;
+        loff_t pos;
+        int minor;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+        return -EOPNOTSUPP;     // never reached, set_spill leaves spill_file NULL
+#else
+        if(the_object->spill_max[priority] > 0 && the_object->spill_bytes[priority] + len > the_object->spill_max[priority])
+            return -ENOSPC;
+        ack = NULL;
+        if(priority == 0 && sess_info != NULL){
+            ack = (spill_ack *)kmalloc(sizeof(spill_ack), GFP_KERNEL);
+            if(ack == NULL)
+                return -ENOMEM;
+        }
+
+        length = len;
+        pos = the_object->spill_tail[priority];
+        if(kernel_write(the_object->spill_file[priority], &length, sizeof(unsigned int), &pos) != sizeof(unsigned int) ||
+                kernel_write(the_object->spill_file[priority], buffer, len, &pos) != len){
+            kfree((void*)ack);
+            return -EIO;
+        }
+
+        minor = the_object - objects;
+        if(ack != NULL){
+            ack->pos = the_object->spill_tail[priority];
+            ack->seq = ++low_submit_seq[minor];
+            sess_info->last_seq = ack->seq;
+            ack->ring = READ_ONCE(sess_info->completions);
+            if(ack->ring != NULL)
+                kref_get(&(ack->ring->refs));
+            list_add_tail(&(ack->node), &(the_object->spill_acks));
+        }
+        the_object->spill_tail[priority] = pos;
+        the_object->spill_bytes[priority] += len;
+        spilled_bytes[minor] += len;
+        return len;
+#endif
+}
+
+
+/** refill_from_spill - move the oldest spilled records of the flow back into its memory, as long as they fit.
+ *  Must be called with the lock of the flow held and, for the low flow, with no pending deferred write.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *
+ *  Return: the number of bytes read back
+ *  */
+static int refill_from_spill(object_state *the_object, int priority){
+        struct file *file;
+        spill_ack *ack;
+        unsigned int length;
+        char *buffer;
+        loff_t pos;
+        int refilled;
+        int minor;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+        return 0;               // never reached, set_spill leaves spill_file NULL
+#else
+        file = the_object->spill_file[priority];
+        refilled = 0;
+        while(the_object->spill_bytes[priority] > 0){
+            pos = the_object->spill_head[priority];
+            if(kernel_read(file, &length, sizeof(unsigned int), &pos) != sizeof(unsigned int))
+                break;
+            if(length > the_object->total_free_bytes[priority])
+                break;
+            buffer = (char*)kmalloc(length, GFP_KERNEL);
+            if(buffer == NULL)
+                break;
+            if(kernel_read(file, buffer, length, &pos) != length || append_to_flow(the_object, priority, buffer, length) < 0){
+                kfree((void*)buffer);
+                break;
+            }
+            kfree((void*)buffer);
+            the_object->total_free_bytes[priority] -= length;
+            // a mirrored record has no acknowledgement
+            ack = list_first_entry_or_null(&(the_object->spill_acks), spill_ack, node);
+            if(priority == 0 && ack != NULL && ack->pos == the_object->spill_head[priority])
+                ack_spilled_write(the_object, ack, length);
+            the_object->spill_head[priority] = pos;
+            the_object->spill_bytes[priority] -= length;
+            refilled += length;
+        }
+
+        if(the_object->spill_bytes[priority] == 0){
+            // the file is written again from the start
+            the_object->spill_head[priority] = 0;
+            the_object->spill_tail[priority] = 0;
+        }
+        else
+            vfs_fadvise(file, the_object->spill_head[priority], SPILL_READAHEAD, POSIX_FADV_WILLNEED);
+        if(priority == 0)
+            the_object->submit_tail = the_object->stream_tail[0];  // the next writes go after the data read back
+
+        minor = the_object - objects;
+        spill_refilled_bytes[minor] += refilled;
+        return refilled;
+#endif
+}
+
+
+/** ack_spilled_write - post the completion of a spilled low priority write that was read back into the flow, and
+ *  account it as applied. Must be called with the lock of the low flow held.
+ *  @the_object: object_state of the device file
+ *  @ack: the acknowledgement of the write, freed here
+ *  @len: bytes read back
+ *  */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+static void ack_spilled_write(object_state *the_object, spill_ack *ack, int len){
+        int minor;
+
+        minor = the_object - objects;
+        if(ack->ring != NULL){
+            post_completion(ack->ring, ack->seq, len, 0);
+            kref_put(&(ack->ring->refs), free_completion_ring);
+        }
+        if(ack->seq > low_applied_seq[minor])
+            low_applied_seq[minor] = ack->seq;
+        list_del(&(ack->node));
+        kfree((void*)ack);
+}
+#endif
+
+
+/** do_spill_work - read the spilled records of a minor back into its flows, scheduled when a read makes room.
+ *  @work: the work_struct of the spill_work of the minor
+ *  */
+static void do_spill_work(struct work_struct *work){
+        object_state *the_object;
+        int refilled;
+        int j;
+
+        the_object = container_of(work, object_state, spill_work);
+        for(j=0;j<NR_FLOWS;j++){
+            if(READ_ONCE(the_object->spill_bytes[j]) == 0)
+                continue;
+            mutex_lock(&(the_object->operation_synchronizer[j]));
+            if(j == 0)
+                drain_deferred_writes(the_object);  // they were accepted before the spilled data
+            refilled = refill_from_spill(the_object, j);
+            mutex_unlock(&(the_object->operation_synchronizer[j]));
+            if(refilled > 0)
+                wake_up_readers(the_object, j);
+            wake_up_flow(the_object, j);
+        }
+}
+
+
+/** set_spill - set, replace or remove the spill file of a flow. The file cannot change while it holds data that was not
+ *  read back yet.
+ *  @minor: minor number of the device file
+ *  @priority: data flow priority
+ *  @param: user pointer to a spill_info struct
+ *
+ *  Return: 0 in case of success, -EBUSY if the current file holds data, -EPERM without CAP_SYS_ADMIN, -EOPNOTSUPP
+ *  before Linux 4.19, a negative error otherwise
+ *  */
+static int set_spill(int minor, int priority, const void __user *param){
+        object_state *the_object;
+        struct file *file;
+        struct file *old;
+        spill_info info;
+        int ret;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+        return -EOPNOTSUPP;     // no vfs_fadvise, and kernel_read/kernel_write without a position before 4.14
+#endif
+        // the driver creates or truncates the file with its own credentials
+        if(!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if(copy_from_user(&info, param, sizeof(spill_info)))
+            return -EFAULT;
+        info.path[SPILL_PATH_LEN-1] = '\0';
+        the_object = objects + minor;
+
+        file = NULL;
+        if(info.path[0] != '\0'){
+            file = filp_open(info.path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+            if(IS_ERR(file))
+                return PTR_ERR(file);
+        }
+        if(mutex_lock_interruptible(&(the_object->operation_synchronizer[priority]))){
+            if(file != NULL)
+                filp_close(file, NULL);
+            return -EINTR;
+        }
+
+        ret = 0;
+        if(the_object->spill_bytes[priority] > 0){
+            ret = -EBUSY;
+            old = file;
+        }
+        else{
+            old = the_object->spill_file[priority];
+            the_object->spill_file[priority] = file;
+            the_object->spill_head[priority] = 0;
+            the_object->spill_tail[priority] = 0;
+            the_object->spill_max[priority] = info.max_bytes;
+        }
+        mutex_unlock(&(the_object->operation_synchronizer[priority]));
+        wake_up_flow(the_object, priority);
+
+        if(old != NULL)
+            filp_close(old, NULL);
+        return ret;
+}
+
+
+/* Operations of the completion fd */
+static struct file_operations cq_fops = {
+        .owner = THIS_MODULE,
+        .read = cq_read,
+        .poll = cq_poll,
+        .release = cq_release
+};
+
+
+/** free_completion_ring - release function of the completion ring, called when the last reference is dropped.
+ *  @refs: the kref of the ring
+ *  */
+static void free_completion_ring(struct kref *refs){
+        kfree((void*)container_of(refs, completion_ring, refs));
+}
+
+
+/** post_completion - add the acknowledgement of a deferred write to a completion ring. If the ring is full the entry
+ *  is lost, the reader sees the gap in the sequence numbers.
+ *  @ring: the completion ring
+ *  @seq: sequence number of the deferred write
+ *  @len: bytes appended
+ *  @status: 0 in case of success, the error otherwise
+ *  */
+static void post_completion(completion_ring *ring, u64 seq, u32 len, s32 status){
+        completion_entry *entry;
+
+        spin_lock(&(ring->lock));
+        if(ring->tail - ring->head == COMPLETION_RING_SIZE){
+            spin_unlock(&(ring->lock));
+            completions_lost[ring->minor] += 1;
+            return;
+        }
+        entry = &(ring->entries[ring->tail & (COMPLETION_RING_SIZE - 1)]);
+        entry->seq = seq;
+        entry->len = len;
+        entry->status = status;
+        ring->tail++;
+        spin_unlock(&(ring->lock));
+        wake_up_interruptible(&(ring->wq));
+}
+
+
+/** open_completions - create the completion ring of the session, if needed, and return a new fd to read it.
+ *  @minor: minor number of the device file
+ *  @sess_info: io_sess_info struct of the calling session
+ *
+ *  Return: the new fd, or a negative error
+ *  */
+static int open_completions(int minor, io_sess_info *sess_info){
+        completion_ring *ring;
+        completion_ring *new_ring;
+        int fd;
+
+        ring = READ_ONCE(sess_info->completions);
+        if(ring == NULL){
+            new_ring = (completion_ring *)kzalloc(sizeof(completion_ring), GFP_KERNEL);
+            if(new_ring == NULL)
+                return -ENOMEM;
+            kref_init(&(new_ring->refs));   // reference of the session
+            spin_lock_init(&(new_ring->lock));
+            init_waitqueue_head(&(new_ring->wq));
+            new_ring->minor = minor;
+
+            // threads sharing the session can get here together, only one ring is published
+            ring = cmpxchg(&(sess_info->completions), NULL, new_ring);
+            if(ring != NULL)
+                kfree((void*)new_ring);
+            else
+                ring = new_ring;
+        }
+
+        kref_get(&(ring->refs));    // reference of the fd
+        fd = anon_inode_getfd("multistream-completions", &cq_fops, ring, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            kref_put(&(ring->refs), free_completion_ring);
+        return fd;
+}
+
+
+/** cq_read - read whole completion entries from the completion fd. It blocks until at least one entry is available,
+ *  unless the fd is non blocking.
+ *  */
+static ssize_t cq_read(struct file *filp, char __user *buff, size_t len, loff_t *off){
+        completion_ring *ring;
+        completion_entry entry;
+        size_t total_len;
+        int ret;
+
+        ring = (completion_ring *)(filp->private_data);
+        if(len < sizeof(completion_entry))
+            return -EINVAL;
+
+        if(READ_ONCE(ring->head) == READ_ONCE(ring->tail)){
+            if(filp->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            ret = wait_event_interruptible(ring->wq, READ_ONCE(ring->head) != READ_ONCE(ring->tail));
+            if(ret)
+                return -EINTR;
+        }
+
+        total_len = 0;
+        while(total_len + sizeof(completion_entry) <= len){
+            spin_lock(&(ring->lock));
+            if(ring->head == ring->tail){
+                spin_unlock(&(ring->lock));
+                break;
+            }
+            entry = ring->entries[ring->head & (COMPLETION_RING_SIZE - 1)];
+            ring->head++;
+            spin_unlock(&(ring->lock));
+
+            if(copy_to_user(buff + total_len, &entry, sizeof(completion_entry)))
+                return total_len ? total_len : -EFAULT;
+            total_len += sizeof(completion_entry);
+        }
+        return total_len;
+}
+
+
+/** cq_poll - the completion fd is readable when the ring holds at least one entry.
+ *  */
+static __poll_t cq_poll(struct file *filp, poll_table *wait){
+        completion_ring *ring;
+
+        ring = (completion_ring *)(filp->private_data);
+        poll_wait(filp, &(ring->wq), wait);
+        if(READ_ONCE(ring->head) != READ_ONCE(ring->tail))
+            return EPOLLIN | EPOLLRDNORM;
+        return 0;
+}
+
+
+/** cq_release - drop the reference of the fd to the completion ring, which is freed once the session is closed too.
+ *  */
+static int cq_release(struct inode *inode, struct file *filp){
+        kref_put(&(((completion_ring *)(filp->private_data))->refs), free_completion_ring);
+        return 0;
+}
+
+
+/** replay_pending - check if the session is reading again data before its read position, after an lseek.
+ *  A replay position that went out of the retention window is moved to the oldest retained byte.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @cursor: the cursor returned by session_cursor
+ *
+ *  Return: 1 if the next read has to be served from replay_offset, 0 otherwise
+ *  */
+static int replay_pending(object_state *the_object, io_sess_info *sess_info, read_cursor *cursor){
+        int priority;
+        u64 limit;
+
+        priority = sess_info->priority;
+        if(!sess_info->replay_active[priority])
+            return 0;
+
+        limit = (cursor != NULL) ? cursor->offset : the_object->stream_head[priority];
+        if(sess_info->replay_offset[priority] < the_object->retain_head[priority])
+            sess_info->replay_offset[priority] = the_object->retain_head[priority];
+        if(sess_info->replay_offset[priority] >= limit){
+            sess_info->replay_active[priority] = 0;
+            return 0;
+        }
         return 1;
 }
 
 
-/** try_wait_for_data - put the thread in the wait queue for a read/write operation that cannot read or write 
- *  due to lack of space on the device file or lack of data.
- *  @timeout: timeout passed to wait_event_interruptible_timeout_exclusive
+/** reclaim_fanout_data - in fan-out mode, drop the data that every active cursor of the flow has already read.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  */
+static void reclaim_fanout_data(object_state *the_object, int priority){
+        read_cursor *cursor;
+        u64 min_offset;
+
+        if(list_empty(&(the_object->cursors[priority])))
+            return;
+
+        min_offset = the_object->stream_tail[priority];
+        list_for_each_entry(cursor, &(the_object->cursors[priority]), node){
+            if(cursor->offset < min_offset)
+                min_offset = cursor->offset;
+        }
+        if(min_offset > the_object->stream_head[priority])
+            consume_stream_data(the_object, priority, (int)(min_offset - the_object->stream_head[priority]));
+}
+
+
+/** session_cursor - get the cursor the session reads through. In fan-out mode the cursor (of the session, or of its
+ *  consumer group) is attached to the flow on the first read, starting from the oldest byte still held.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @sess_info: io_sess_info struct of the calling session
+ *
+ *  Return: the cursor, or NULL if the device file is not in fan-out mode and reads are destructive
+ *  */
+static read_cursor* session_cursor(object_state *the_object, io_sess_info *sess_info){
+        read_cursor *cursor;
+        int priority;
+
+        if(!the_object->fanout)
+            return NULL;
+
+        priority = sess_info->priority;
+        if(sess_info->group != NULL)
+            cursor = &(sess_info->group->cursors[priority]);
+        else
+            cursor = &(sess_info->cursors[priority]);
+        if(!cursor->active){
+            cursor->offset = the_object->stream_head[priority];
+            cursor->active = 1;
+            list_add_tail(&(cursor->node), &(the_object->cursors[priority]));
+        }
+        return cursor;
+}
+
+
+/** readable_bytes - number of bytes that can be read from a flow through a cursor.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @cursor: the cursor returned by session_cursor
+ *  */
+static int readable_bytes(object_state *the_object, int priority, read_cursor *cursor){
+        if(cursor == NULL)
+            return the_object->valid_bytes[priority];
+        return (int)(the_object->stream_tail[priority] - cursor->offset);
+}
+
+
+/** add_record - mark the current tail of the flow as the end of a record. If the descriptor cannot be allocated the
+ *  record is merged with the following one, so that the data is never lost.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  */
+static void add_record(object_state *the_object, int priority){
+        record_desc *record;
+
+        record = (record_desc *)kmalloc(sizeof(record_desc), GFP_ATOMIC);
+        if(record == NULL){
+#ifdef DEBUG_INFO
+            printk("%s: record descriptor allocation failed\n", MODNAME);
+#endif
+            return;
+        }
+        record->end_offset = the_object->stream_tail[priority];
+        record->stamp = ktime_get();
+        list_add_tail(&(record->node), &(the_object->records[priority]));
+}
+
+
+/** record_bytes - number of bytes of the whole records that fit in len, starting from a record boundary. 
+ *  The data after the last descriptor, if any, is treated as a single record.
+ *  Must be called with the lock of the flow held.
+ *  @the_object: object_state of the device file
+ *  @priority: data flow priority
+ *  @start: logical offset where the read starts
+ *  @len: size of the reader buffer, at most the readable bytes
+ *
+ *  Return: the number of bytes, or -EMSGSIZE if the first record does not fit the buffer
+ *  */
+static int record_bytes(object_state *the_object, int priority, u64 start, int len){
+        record_desc *record;
+        u64 end;
+
+        end = start;
+        list_for_each_entry(record, &(the_object->records[priority]), node){
+            if(record->end_offset <= start)
+                continue;
+            if(record->end_offset - start > len)
+                break;
+            end = record->end_offset;
+        }
+        if(end == start){
+            if(the_object->stream_tail[priority] - start > len)
+                return -EMSGSIZE;
+            end = the_object->stream_tail[priority];
+        }
+        return (int)(end - start);
+}
+
+
+/** join_group - make the session a member of a consumer group of the device file, creating the group if needed.
+ *  The session leaves the group it was member of, if any.
  *  @minor: minor number of the device file
- *  @value: value checked for the wait condition
- *  @event: sleep event, can be
- *   - WAIT_WRITE
- *   - WAIT_READ
+ *  @sess_info: io_sess_info struct of the calling session
+ *  @name: user pointer to the name of the group, an empty name (or NULL) only leaves the current group
  *
- *   Return:
- *    - 1 in case of success
- *    - 0 in case of failure
+ *  Return: 0 in case of success, a negative error code otherwise
  *  */
-int try_wait_for_data(io_sess_info* sess_info, int minor, int value, int event){
-        int ret; 
-        if (sess_info->priority)
-             high_wait_data[minor] += 1;
-         else
-             low_wait_data[minor] += 1;
+static int join_group(int minor, io_sess_info *sess_info, const char __user *name){
+        object_state *the_object;
+        consumer_group *group;
+        char group_name[GROUP_NAME_LEN];
+        long ret;
+        int j;
 
-        ret = do_sleep_wqe(sess_info->timeout, minor, sess_info->priority, value, event);
-        if (sess_info->priority)
-             high_wait_data[minor] -= 1;
-         else
-             low_wait_data[minor] -= 1;
+        the_object = objects + minor;
+        group_name[0] = '\0';
+        if(name != NULL){
+            ret = strncpy_from_user(group_name, name, GROUP_NAME_LEN);
+            if(ret < 0)
+                return -EFAULT;
+            if(ret == GROUP_NAME_LEN)
+                return -EINVAL;
+        }
 
-         return ret;
+        leave_group(minor, sess_info);
+        if(group_name[0] == '\0')
+            return 0;
+
+        mutex_lock(&(the_object->groups_lock));
+        list_for_each_entry(group, &(the_object->groups), node){
+            if(strcmp(group->name, group_name) == 0)
+                goto group_found;
+        }
+
+        group = (consumer_group *)kzalloc(sizeof(consumer_group), GFP_KERNEL);
+        if(group == NULL){
+            mutex_unlock(&(the_object->groups_lock));
+            return -ENOMEM;
+        }
+        strscpy(group->name, group_name, GROUP_NAME_LEN);
+        for(j=0;j<NR_FLOWS;j++){
+            group->cursors[j].active = 0;
+            group->cursors[j].missed = 0;
+            INIT_LIST_HEAD(&(group->cursors[j].node));
+        }
+        list_add_tail(&(group->node), &(the_object->groups));
+#ifdef DEBUG_INFO
+        printk("%s: created consumer group %s on minor %d\n", MODNAME, group_name, minor);
+#endif
+
+group_found:
+        group->members++;
+        sess_info->group = group;
+        mutex_unlock(&(the_object->groups_lock));
+        return 0;
+}
+
+
+/** leave_group - remove the session from its consumer group. The last member that leaves destroys the group, 
+ *  detaching its cursors from the flows.
+ *  @minor: minor number of the device file
+ *  @sess_info: io_sess_info struct of the calling session
+ *  */
+static void leave_group(int minor, io_sess_info *sess_info){
+        object_state *the_object;
+        consumer_group *group;
+        int j;
+
+        the_object = objects + minor;
+        mutex_lock(&(the_object->groups_lock));
+        group = sess_info->group;
+        if(group == NULL){
+            mutex_unlock(&(the_object->groups_lock));
+            return;
+        }
+        sess_info->group = NULL;
+        group->members--;
+        if(group->members > 0){
+            mutex_unlock(&(the_object->groups_lock));
+            return;
+        }
+
+        for(j=0;j<NR_FLOWS;j++){
+            mutex_lock(&(the_object->operation_synchronizer[j]));
+            if(group->cursors[j].active){
+                list_del_init(&(group->cursors[j].node));
+                group->cursors[j].active = 0;
+                reclaim_fanout_data(the_object, j);
+            }
+            mutex_unlock(&(the_object->operation_synchronizer[j]));
+            wake_up_flow(the_object, j);
+        }
+        list_del(&(group->node));
+        mutex_unlock(&(the_object->groups_lock));
+        kfree((void*)group);
+}
+
+
+/** set_fanout_mode - enable or disable the fan-out mode on a device file. When the mode is disabled, all the cursors
+ *  are detached and the data not yet read by the slowest one is left to destructive reads.
+ *  @minor: minor number of the device file
+ *  @param: 1 to enable the fan-out mode, 0 to disable it
+ *
+ *  Return: 0 in case of success, -1 if the parameter is not valid
+ *  */
+static int set_fanout_mode(int minor, unsigned long param){
+        object_state *the_object;
+        read_cursor *cursor;
+        read_cursor *next;
+        int j;
+
+        if(param > 1)
+            return -1;
+
+        the_object = objects + minor;
+        for(j=0;j<NR_FLOWS;j++){
+            mutex_lock(&(the_object->operation_synchronizer[j]));
+            the_object->fanout = (int)param;
+            if(!param){
+                list_for_each_entry_safe(cursor, next, &(the_object->cursors[j]), node){
+                    list_del_init(&(cursor->node));
+                    cursor->active = 0;
+                }
+            }
+            mutex_unlock(&(the_object->operation_synchronizer[j]));
+            wake_up_interruptible_all(&(the_object->the_wq_head[j]));
+        }
+        return 0;
 }
 
 
@@ -834,6 +4477,9 @@ static struct file_operations fops = {
         .read = dev_read,
         .open =  dev_open,
         .release = dev_release,
+        .llseek = dev_llseek,
+        .fsync = dev_fsync,
+        .flush = dev_flush,
         .unlocked_ioctl = dev_ioctl
 };
 
@@ -849,6 +4495,26 @@ int init_module(void) {
 #ifdef SINGLE_SESSION_OBJECT
 		    mutex_init(&(objects[i].object_busy));
 #endif
+            objects[i].fanout = 0;
+            objects[i].submit_tail = 0;
+            objects[i].overwrite = 0;
+            objects[i].mirror_sources = 0;
+            objects[i].nr_shards = 0;
+            objects[i].shard_next = 0;
+            objects[i].shard_leader = -1;
+            init_bucket(&(objects[i].write_limit), 0, 0);
+            objects[i].age_msecs = 0;
+            INIT_LIST_HEAD(&(objects[i].handoff_reqs));
+            INIT_LIST_HEAD(&(objects[i].deferred_writes));
+            INIT_LIST_HEAD(&(objects[i].spill_acks));
+            objects[i].deferred_bytes = 0;
+            INIT_DELAYED_WORK(&(objects[i].batch_work), do_batch_work);
+            INIT_WORK(&(objects[i].spill_work), do_spill_work);
+            objects[i].worker = NULL;
+            spin_lock_init(&(objects[i].handoff_lock));
+            INIT_DELAYED_WORK(&(objects[i].aging_work), do_aging_work);
+            mutex_init(&(objects[i].groups_lock));
+            INIT_LIST_HEAD(&(objects[i].groups));
             /* allocate the first page for each priority flow*/
 		    for(j=0;j<2;j++){
                 object_content *first_page;
@@ -856,6 +4522,22 @@ int init_module(void) {
                 init_waitqueue_head(&(objects[i].the_wq_head[j])); 
                 objects[i].valid_bytes[j] = 0; 
                 objects[i].total_free_bytes[j] = OBJECT_MAX_SIZE*MAX_PAGES;    // setup the default total size
+                objects[i].stream_head[j] = 0;
+                objects[i].stream_tail[j] = 0;
+                objects[i].chain_base[j] = 0;
+                objects[i].retain_head[j] = 0;
+                objects[i].retain_bytes[j] = 0;
+                objects[i].retain_msecs[j] = 0;
+                objects[i].ttl_msecs[j] = 0;
+                objects[i].dropped_total[j] = 0;
+                objects[i].nr_links[j] = 0;
+                objects[i].spill_file[j] = NULL;
+                objects[i].spill_head[j] = 0;
+                objects[i].spill_tail[j] = 0;
+                objects[i].spill_bytes[j] = 0;
+                objects[i].spill_max[j] = 0;
+                INIT_LIST_HEAD(&(objects[i].cursors[j]));
+                INIT_LIST_HEAD(&(objects[i].records[j]));
             
                 objects[i].list_heads[j] = (object_content *)kzalloc(sizeof(object_content), GFP_KERNEL);
                 if(objects[i].list_heads[j] == NULL){
@@ -874,12 +4556,14 @@ int init_module(void) {
                     kfree((void*)first_page);
                     goto revert_allocation;
                 }
-                first_page->read_offset = 0;
                 first_page->next = NULL;
                 first_page->record_length = 0; 
                 objects[i].list_heads[j]->next = first_page;
             
                 mutex_init(&(objects[i].operation_synchronizer[j]));
+                spin_lock_init(&(objects[i].lock_queue_lock[j]));
+                objects[i].lock_queue_head[j] = NULL;
+                objects[i].lock_queue_tail[j] = NULL;
             }
         }
 
@@ -916,7 +4600,13 @@ void cleanup_module(void) {
         int i;
         int j;
         object_content* temp_obj;
+        cancel_delayed_work_sync(&expiry_work);
 	    for(i=0;i<MINORS;i++){
+            objects[i].age_msecs = 0;
+            cancel_delayed_work_sync(&(objects[i].aging_work));
+            cancel_delayed_work_sync(&(objects[i].batch_work));   // pending deferred writes hold a module reference, so
+            stop_worker(objects + i);                             // none is left here: the minors were drained or cancelled
+            cancel_work_sync(&(objects[i].spill_work));
             for(j=0;j<2;j++){
                 if(objects[i].list_heads[j]->next != NULL){
                     temp_obj = objects[i].list_heads[j]->next;
@@ -928,8 +4618,23 @@ void cleanup_module(void) {
                         kfree((void*)free_node);
                     }
                 } 
+                while(!list_empty(&(objects[i].records[j]))){
+                    record_desc *record = list_first_entry(&(objects[i].records[j]), record_desc, node);
+                    list_del(&(record->node));
+                    kfree((void*)record);
+                }
                 kfree((void*)objects[i].list_heads[j]); 
+                if(objects[i].spill_file[j] != NULL)
+                    filp_close(objects[i].spill_file[j], NULL);
 	        }
+            // the writes still in a spill file are lost with it
+            while(!list_empty(&(objects[i].spill_acks))){
+                spill_ack *ack = list_first_entry(&(objects[i].spill_acks), spill_ack, node);
+                list_del(&(ack->node));
+                if(ack->ring != NULL)
+                    kref_put(&(ack->ring->refs), free_completion_ring);
+                kfree((void*)ack);
+            }
         }
 
 	    unregister_chrdev(Major, DEVICE_NAME);
@@ -7,12 +7,26 @@
 #include <linux/workqueue.h>
 #include <linux/semaphore.h>
 #include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/kref.h>
+#include <linux/types.h>
 
 
-enum ctl_ops{SET_PRIO=1, SET_BLOCKING=3, SET_OPENCLOSE=4};  // used by ioctl to determine which command was called 
-enum wait_ops{WAIT_MUTEX, WAIT_WRITE, WAIT_READ};           // used to determine the type of wait event in the wait queue function
+enum ctl_ops{SET_PRIO=1, SET_BLOCKING=3, SET_OPENCLOSE=4, SET_FANOUT=5, JOIN_GROUP=6, SET_RETENTION=7, GET_WRITE_OFFSET=8, SET_OVERWRITE=9, GET_MISSED=10, LINK_MINOR=11, UNLINK_MINOR=12, GET_LINKS=13, SET_SHARDS=14, SET_SHARD_KEY=15, MULTI_READ=16, SET_RATE_LIMIT=17, GET_WAIT_STATS=18, SET_AGING=19, SET_TTL=20, SET_TIMEOUT_NS=21, SET_NEXT_TIMEOUT_NS=22, SET_SPIN_USECS=23, SET_ORDERING=24, SYNC_WRITES=25, OPEN_COMPLETIONS=26, SET_BATCH=27, SET_WORKER=28, QUIESCE=29, EXPORT_IMAGE=30, IMPORT_IMAGE=31, SET_SPILL=32};  // used by ioctl to determine which command was called 
+enum openclose_ops{OPEN_ENABLE=0, CLOSE_DRAIN=1, CLOSE_CANCEL=2};    // parameter of SET_OPENCLOSE
+enum wait_ops{WAIT_MUTEX, WAIT_WRITE, WAIT_READ, WAIT_CURSOR, WAIT_SHARDS, WAIT_HANDOFF};           // used to determine the type of wait event in the wait queue function
 
 #define NR_FLOWS 2
+#define GROUP_NAME_LEN 32   // max length of the name of a consumer group, including the terminator
+#define MAX_LINKS 4         // max number of destination minors that a flow can be mirrored to
+#define MAX_SHARDS 8        // max number of member minors of a shard group
+#define SHARD_BY_CPU (~0UL) // shard key that spreads the writes of a session by the current CPU
+#define COMPLETION_RING_SIZE 256  // entries of the completion ring of a session, a power of two
+#define MAX_MULTI_SOURCES 64    // max number of flows that a MULTI_READ can drain
+#define NO_NEXT_TIMEOUT (~0UL)  // value of next_timeout_ns when no one shot timeout is set
+#define SPILL_PATH_LEN 128      // max length of the path of a spill file, including the terminator
 
 /* The data information for the object, 
  * used to keep track of the situation in terms of bytes.
@@ -20,21 +34,134 @@ enum wait_ops{WAIT_MUTEX, WAIT_WRITE, WAIT_READ};           // used to determine
  * */
 typedef struct _object_content{
     int record_length;
-    int read_offset;
     char *stream_content;
     struct _object_content *next;
 } object_content;
 
 
+/* Read position of a consumer in fan-out mode. The offset is a logical stream offset, that is the number
+ * of bytes appended to the flow since the module was loaded, so it never wraps together with the pages
+ * */
+typedef struct _read_cursor{
+    u64 offset;             // logical offset of the next byte to read
+    int active;             // 1 if the cursor is linked in the cursor list of the flow
+    u64 missed;             // bytes dropped before the cursor could read them, not yet reported with GET_MISSED
+    struct list_head node;
+} read_cursor;
+
+
+/* End of a record, that is the data passed to a single write. The descriptors of a flow are kept in 
+ * append order and are released as soon as the head of the flow goes past them
+ * */
+typedef struct _record_desc{
+    u64 end_offset;         // logical offset of the byte following the record
+    ktime_t stamp;          // time of the write, used by the time based retention
+    struct list_head node;
+} record_desc;
+
+
+/* A named set of sessions that share the same read position: the records of the flow are delivered
+ * whole to one of the members, so that each group consumes the stream independently of the others
+ * */
+typedef struct _consumer_group{
+    char name[GROUP_NAME_LEN];
+    int members;                    // number of sessions that joined the group, protected by groups_lock
+    read_cursor cursors[NR_FLOWS];  // group read positions, used when the device file is in fan-out mode
+    struct list_head node;
+} consumer_group;
+
+
+/* Destination of the mirror of a flow: every write accepted by the source flow is appended also to the same flow
+ * of the destination minor
+ * */
+typedef struct _mirror_link{
+    int minor;                      // destination minor
+    unsigned long mirrored_bytes;   // bytes appended to the destination
+    unsigned long dropped_bytes;    // bytes not mirrored because the destination flow was full
+} mirror_link;
+
+
+/* Token bucket limiting the write rate of a session or of a minor. Credits are kept in byte-microseconds (and 
+ * op-microseconds), so that slow rates are refilled without rounding errors; the bucket holds at most one second
+ * of traffic
+ * */
+typedef struct _token_bucket{
+    unsigned long bytes_rate;   // bytes per second, 0 means no limit
+    unsigned long ops_rate;     // write operations per second, 0 means no limit
+    u64 bytes_credit;
+    u64 ops_credit;
+    ktime_t last_refill;
+    spinlock_t lock;
+} token_bucket;
+
+
+/* Acknowledgement of a deferred write, read from the completion fd of the session */
+typedef struct _completion_entry{
+    u64 seq;        // sequence number of the deferred write on its minor
+    u32 len;        // bytes appended to the low flow
+    s32 status;     // 0, or the error that made the write fail
+} completion_entry;
+
+
+/* Completion ring of a session. It is shared by the session, its completion fd and the deferred writes still
+ * pending, and freed when the last of them drops its reference
+ * */
+typedef struct _completion_ring{
+    struct kref refs;
+    spinlock_t lock;
+    wait_queue_head_t wq;           // readers of the completion fd
+    unsigned int head;              // next entry to read
+    unsigned int tail;              // next entry to post
+    int minor;
+    completion_entry entries[COMPLETION_RING_SIZE];
+} completion_ring;
+
+
 /* Struct used to handle control information for a given session
  * This is copied in the private_data field of the struct file
  * */
 typedef struct _io_sess_info{
     int priority;
-    long timeout;
+    u64 timeout_ns;                 // default max wait of the blocking operations, in nanoseconds (0: non blocking)
+    unsigned long next_timeout_ns;  // one shot timeout of the next operation, NO_NEXT_TIMEOUT if not set
+    unsigned long spin_usecs;       // busy poll budget before sleeping, in microseconds (0: sleep right away)
+    int relaxed_order;              // deferred writes of the session do not wait for the earlier ones
+    u64 last_seq;                   // sequence number of the last deferred write of the session
+    completion_ring *completions;   // acknowledgements of the deferred writes, NULL until OPEN_COMPLETIONS
+    read_cursor cursors[NR_FLOWS];  // per flow read positions, used only when the device file is in fan-out mode
+    consumer_group *group;          // consumer group joined by the session, NULL if none
+    u64 write_offset;               // logical offset of the first byte of the last write of the session
+    u64 replay_offset[NR_FLOWS];    // position set with lseek, used to read again data that is already consumed
+    int replay_active[NR_FLOWS];
+    u64 dropped_seen[NR_FLOWS];     // value of dropped_total at the last GET_MISSED, used for destructive reads
+    unsigned long shard_key;        // selects the member of a shard group written by the session, or SHARD_BY_CPU
+    token_bucket write_limit;       // rate limit of the writes of the session
+    u64 lock_waits;                 // number of times the session had to queue for a flow lock
+    u64 lock_timeouts;              // queued waits that ended without the lock
+    u64 lock_wait_total;            // total time spent queued for a flow lock, in microseconds
+    u64 lock_wait_max;              // longest queued wait, in microseconds
 } io_sess_info;
 
 
+/* Timeout of an operation in progress. It is kept by the thread running the operation, so that threads sharing the 
+ * session do not overwrite each other's deadline
+ * */
+typedef struct _op_deadline{
+    u64 timeout;                    // timeout of the operation, in nanoseconds (0: non blocking)
+    ktime_t deadline;               // absolute deadline, shared by all the waits of the operation
+} op_deadline;
+
+
+/* A reader parked on the empty high flow, waiting for a writer to copy the data directly in its buffer */
+typedef struct _handoff_req{
+    char *buffer;                   // kernel buffer of the reader
+    int len;                        // size of the buffer
+    int filled;                     // bytes copied by the writer, -1 until the request is served
+    struct task_struct *task;       // the parked reader
+    struct list_head node;          // linked in the handoff_reqs of the flow while parked
+} handoff_req;
+
+
 typedef struct _queue_elem{
     struct task_struct *the_task;
     int already_hit;
@@ -58,6 +185,47 @@ typedef struct _object_state{
         int total_free_bytes[NR_FLOWS];    // the number of free bytes, can depend also on bytes reserved in the low priority flow
         object_content* list_heads[NR_FLOWS];
         wait_queue_head_t the_wq_head[NR_FLOWS];
+        u64 stream_head[NR_FLOWS];         // logical offset of the first byte still held by the flow
+        u64 stream_tail[NR_FLOWS];         // logical offset of the next byte that will be appended
+        u64 chain_base[NR_FLOWS];          // logical offset of the first byte of the first page in the list
+        int fanout;                        // 1 if every session reads the flows through its own cursor
+        struct list_head cursors[NR_FLOWS];    // active read_cursor entries, used to know when a page can be freed
+        struct list_head records[NR_FLOWS];    // record_desc entries of the data still held by the flow
+        struct mutex groups_lock;              // protects the list of consumer groups, taken before the flow locks
+        struct list_head groups;
+        u64 retain_head[NR_FLOWS];         // logical offset of the oldest byte that can still be read with lseek
+        unsigned long retain_bytes[NR_FLOWS];  // max amount of consumed data kept for replays, 0 with retain_msecs 0 disables the retention
+        unsigned long retain_msecs[NR_FLOWS];  // max age of the consumed data kept for replays, 0 means no time limit
+        u64 submit_tail;                   // logical offset that the next deferred write of the low flow will get
+        int overwrite;                     // 1 if a write to a full flow evicts the oldest data instead of failing
+        u64 dropped_total[NR_FLOWS];       // bytes dropped from the flow before being read
+        mirror_link links[NR_FLOWS][MAX_LINKS];    // mirror destinations of each flow, protected by the flow lock
+        int nr_links[NR_FLOWS];
+        int mirror_sources;                // number of links having this minor as destination, protected by links_lock
+        int shard_members[MAX_SHARDS];     // minors that make up the logical stream, when this minor is a shard leader
+        int nr_shards;
+        int shard_next;                    // member from which the next read of the group starts looking for data
+        int shard_leader;                  // leader of the shard group this minor belongs to, -1 if none
+        token_bucket write_limit;          // rate limit of the writes on the minor, shared by all the sessions
+        queue_elem *lock_queue_head[NR_FLOWS];  // FIFO of the threads waiting for the lock of the flow
+        queue_elem *lock_queue_tail[NR_FLOWS];
+        spinlock_t lock_queue_lock[NR_FLOWS];   // protects the FIFO of the lock waiters
+        unsigned long age_msecs;           // low priority records older than this are promoted to the high flow, 0: never
+        struct delayed_work aging_work;    // periodic promotion of the aged records
+        unsigned long ttl_msecs[NR_FLOWS];      // records older than this are discarded unread, 0: never
+        struct list_head deferred_writes;  // low priority writes not yet appended, in submission order (low flow lock)
+        unsigned long deferred_bytes;      // bytes of the deferred writes not yet appended
+        struct delayed_work batch_work;    // appends the batched deferred writes when the batching window closes
+        struct task_struct *worker;        // dedicated thread appending the deferred writes, NULL if the work queue is used
+        struct list_head handoff_reqs;     // readers parked on the empty high flow, in arrival order
+        spinlock_t handoff_lock;           // protects handoff_reqs
+        struct file *spill_file[NR_FLOWS];     // backing file of the data that does not fit the flow, NULL if none
+        loff_t spill_head[NR_FLOWS];           // file position of the oldest spilled record
+        loff_t spill_tail[NR_FLOWS];           // file position where the next spilled record is written
+        unsigned long spill_bytes[NR_FLOWS];   // data in the spill file, not yet read back into the flow
+        unsigned long spill_max[NR_FLOWS];     // max amount of data in the spill file, 0 means no limit
+        struct work_struct spill_work;         // reads the spilled records back as the readers make room
+        struct list_head spill_acks;           // spill_ack of the low priority writes in the spill file, in file order
 } object_state;
 
 
@@ -68,9 +236,159 @@ typedef struct _packed_write_data_wq{
     int minor;  // the minor number identifing the device
     size_t len; // len of the data buffer
     struct work_struct the_work;  // work queue struct
+    struct list_head node;  // linked in the deferred writes of the minor until the data is appended
+    int done;   // the data was already appended, by a reader or by the work itself
+    u64 seq;    // submission sequence number of the write on its minor
+    int relaxed;    // the write may be appended before the ones submitted earlier
+    completion_ring *ring;  // where the acknowledgement is posted, NULL if the session did not ask for it
+    int has_work;   // the_work was scheduled and frees the struct, otherwise it is freed once the data is appended
 } packed_data_wq;  
 
 
+/* Acknowledgement of a low priority write that went to the spill file, posted when its record is read back */
+typedef struct _spill_ack{
+    struct list_head node;  // linked in the spill_acks of the minor
+    loff_t pos;     // file position of the spilled record
+    u64 seq;        // submission sequence number of the write on its minor
+    completion_ring *ring;  // where the acknowledgement is posted, NULL if the session did not ask for it
+} spill_ack;
+
+
+/* Parameter of the SET_BATCH command, 0 usecs disables the batching of the deferred writes of the minor */
+typedef struct _batch_info{
+    unsigned long usecs;    // max time a deferred write waits for the batch to fill
+    unsigned long bytes;    // the batch is appended as soon as it holds this amount of data, 0 means no limit
+} batch_info;
+
+
+/* Parameter of the SET_WORKER command */
+typedef struct _worker_info{
+    int enable;     // 1: start the dedicated thread of the minor (or change its settings), 0: stop it
+    int policy;     // SCHED_NORMAL or SCHED_FIFO
+    int nice;       // nice level, used with SCHED_NORMAL
+    int cpu;        // CPU the thread is bound to, -1 for any
+} worker_info;
+
+
+/* Parameter of the QUIESCE command, the residual bytes of each flow are also exported as module parameters */
+typedef struct _quiesce_info{
+    int enable;                 // 1: stop accepting writes on all the minors and drain them, 0: accept writes again
+    unsigned long msecs;        // max time to wait for the readers to empty the flows, 0 does not wait
+    unsigned long residual;     // out: bytes still in the flows of all the minors
+    unsigned long busy_minors;  // out: number of minors with residual bytes
+} quiesce_info;
+
+/* Binary image of the device made by EXPORT_IMAGE and loaded by IMPORT_IMAGE: an image_header followed by one
+ * image_minor for each minor with data or settings. Each image_minor is followed, for the low and then the high flow,
+ * by the lengths of the records (unsigned int each) and by their data. EXPORT_IMAGE fails with EBUSY while a spill
+ * file holds data
+ * */
+#define IMAGE_MAGIC 0x4d534931  // "MSI1"
+#define IMAGE_VERSION 1
+
+typedef struct _image_header{
+    __u32 magic;
+    __u32 version;
+    __u32 minors;       // number of image_minor entries
+    __u32 reserved;
+} image_header;
+
+/* Fixed width fields and explicit padding, so that the layout is the same on 32 and 64 bit kernels */
+typedef struct _image_minor{
+    __u32 minor;
+    __u32 disabled;     // value of SET_OPENCLOSE
+    __u32 overwrite;
+    __u32 records[2];   // number of records of each flow (0: low, 1: high)
+    __u32 bytes[2];     // bytes of data of each flow
+    __u32 reserved;
+    __u64 ttl_msecs[2];
+    __u64 age_msecs;
+} image_minor;
+
+/* Parameter of the EXPORT_IMAGE and IMPORT_IMAGE commands */
+typedef struct _image_info{
+    void *buffer;           // user buffer holding the image
+    unsigned long len;      // size of the buffer
+    unsigned long used;     // out: size of the image (export, also when the buffer is too small), bytes restored (import)
+} image_info;
+
+
+/* Parameter of the SET_SPILL command, it applies to the current flow of the session */
+typedef struct _spill_info{
+    char path[SPILL_PATH_LEN];  // file that takes the data not fitting the flow, created or truncated; empty disables
+    unsigned long max_bytes;    // max amount of data kept in the file, 0 means no limit
+} spill_info;
+
+
+/* Parameter of the SET_RETENTION command, it applies to the current flow of the session */
+typedef struct _retention_info{
+    unsigned long bytes;    // amount of consumed data that is kept, 0: up to MAX_RETAIN_PAGES if msecs is set
+    unsigned long msecs;    // consumed data older than this is released anyway, 0 means no time limit
+} retention_info;
+
+
+/* Parameter of the GET_LINKS command, filled with the links of the current flow of the session. The lag is the
+ * amount of data not yet read in the destination flow
+ * */
+typedef struct _link_stats_info{
+    int nr_links;
+    struct {
+        int minor;
+        unsigned long mirrored_bytes;
+        unsigned long dropped_bytes;
+        unsigned long lag;
+    } links[MAX_LINKS];
+} link_stats_info;
+
+
+/* Parameter of the SET_SHARDS command, issued on the leader of the group. The leader can also be a member, 
+ * nr_members set to 0 dissolves the group
+ * */
+typedef struct _shard_group_info{
+    int nr_members;
+    int members[MAX_SHARDS];
+} shard_group_info;
+
+
+/* Parameter of the MULTI_READ command: the flows are drained in the given order, and the user buffer is filled 
+ * with a multi_read_header followed by the data, for each flow that had something to read
+ * */
+typedef struct _multi_read_info{
+    int nr_sources;
+    struct {
+        int minor;
+        int priority;
+    } sources[MAX_MULTI_SOURCES];
+    char __user *buffer;        // user buffer
+    unsigned long len;          // size of the user buffer
+    unsigned long long timeout_ns;  // max wait for data on any of the flows, in nanoseconds (0: timeout of the session)
+} multi_read_info;
+
+
+typedef struct _multi_read_header{
+    int minor;
+    int priority;
+    int len;                    // bytes of data following the header
+} multi_read_header;
+
+
+/* Parameter of the SET_RATE_LIMIT command */
+typedef struct _rate_limit_info{
+    int scope;                      // 0: the calling session, 1: the whole minor
+    unsigned long bytes_per_sec;    // 0 means no limit
+    unsigned long ops_per_sec;      // 0 means no limit
+} rate_limit_info;
+
+
+/* Result of the GET_WAIT_STATS command, times are in microseconds */
+typedef struct _wait_stats_info{
+    unsigned long long waits;
+    unsigned long long timeouts;
+    unsigned long long total_usecs;
+    unsigned long long max_usecs;
+} wait_stats_info;
+
+
 /* Redefinition of the struct used in the user.c program, usefull
  * to deal with the settings of the device driver or the single 
  * device file
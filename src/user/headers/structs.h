@@ -1,7 +1,143 @@
 /* Structs used in the user.c */
 
+#include <linux/types.h>
 
-enum ctl_ops{SET_PRIO=1, SET_BLOCKING=3, SET_OPENCLOSE=4};
+
+enum ctl_ops{SET_PRIO=1, SET_BLOCKING=3, SET_OPENCLOSE=4, SET_FANOUT=5, JOIN_GROUP=6, SET_RETENTION=7, GET_WRITE_OFFSET=8, SET_OVERWRITE=9, GET_MISSED=10, LINK_MINOR=11, UNLINK_MINOR=12, GET_LINKS=13, SET_SHARDS=14, SET_SHARD_KEY=15, MULTI_READ=16, SET_RATE_LIMIT=17, GET_WAIT_STATS=18, SET_AGING=19, SET_TTL=20, SET_TIMEOUT_NS=21, SET_NEXT_TIMEOUT_NS=22, SET_SPIN_USECS=23, SET_ORDERING=24, SYNC_WRITES=25, OPEN_COMPLETIONS=26, SET_BATCH=27, SET_WORKER=28, QUIESCE=29, EXPORT_IMAGE=30, IMPORT_IMAGE=31, SET_SPILL=32};
+enum openclose_ops{OPEN_ENABLE=0, CLOSE_DRAIN=1, CLOSE_CANCEL=2};    // parameter of SET_OPENCLOSE
+
+#define GROUP_NAME_LEN 32   // max length of the name of a consumer group, including the terminator
+#define MAX_LINKS 4         // max number of destination minors that a flow can be mirrored to
+#define MAX_SHARDS 8        // max number of member minors of a shard group
+#define SHARD_BY_CPU (~0UL) // shard key that spreads the writes of a session by the current CPU
+#define MAX_MULTI_SOURCES 64    // max number of flows that a MULTI_READ can drain
+#define SPILL_PATH_LEN 128      // max length of the path of a spill file, including the terminator
+
+
+typedef struct _retention_info{
+    unsigned long bytes;    // amount of consumed data that is kept, 0: up to MAX_RETAIN_PAGES if msecs is set
+    unsigned long msecs;    // consumed data older than this is released anyway, 0 means no time limit
+} retention_info;
+
+
+typedef struct _link_stats_info{
+    int nr_links;
+    struct {
+        int minor;
+        unsigned long mirrored_bytes;
+        unsigned long dropped_bytes;
+        unsigned long lag;
+    } links[MAX_LINKS];
+} link_stats_info;
+
+
+typedef struct _shard_group_info{
+    int nr_members;
+    int members[MAX_SHARDS];
+} shard_group_info;
+
+
+typedef struct _multi_read_info{
+    int nr_sources;
+    struct {
+        int minor;
+        int priority;
+    } sources[MAX_MULTI_SOURCES];
+    char *buffer;               // user buffer
+    unsigned long len;          // size of the user buffer
+    unsigned long long timeout_ns;  // max wait for data on any of the flows, in nanoseconds (0: timeout of the session)
+} multi_read_info;
+
+
+typedef struct _multi_read_header{
+    int minor;
+    int priority;
+    int len;                    // bytes of data following the header
+} multi_read_header;
+
+
+typedef struct _rate_limit_info{
+    int scope;                      // 0: the calling session, 1: the whole minor
+    unsigned long bytes_per_sec;    // 0 means no limit
+    unsigned long ops_per_sec;      // 0 means no limit
+} rate_limit_info;
+
+
+typedef struct _wait_stats_info{
+    unsigned long long waits;
+    unsigned long long timeouts;
+    unsigned long long total_usecs;
+    unsigned long long max_usecs;
+} wait_stats_info;
+
+
+typedef struct _completion_entry{
+    unsigned long long seq;     // sequence number of the deferred write on its minor
+    unsigned int len;           // bytes appended to the low flow
+    int status;                 // 0, or the error that made the write fail
+} completion_entry;
+
+
+typedef struct _batch_info{
+    unsigned long usecs;    // max time a deferred write waits for the batch to fill (0: no batching)
+    unsigned long bytes;    // the batch is appended as soon as it holds this amount of data, 0 means no limit
+} batch_info;
+
+
+typedef struct _worker_info{
+    int enable;     // 1: start the dedicated thread of the minor (or change its settings), 0: stop it
+    int policy;     // SCHED_NORMAL (0) or SCHED_FIFO (1)
+    int nice;       // nice level, used with SCHED_NORMAL
+    int cpu;        // CPU the thread is bound to, -1 for any
+} worker_info;
+
+
+typedef struct _quiesce_info{
+    int enable;                 // 1: stop accepting writes on all the minors and drain them, 0: accept writes again
+    unsigned long msecs;        // max time to wait for the readers to empty the flows, 0 does not wait
+    unsigned long residual;     // out: bytes still in the flows of all the minors
+    unsigned long busy_minors;  // out: number of minors with residual bytes
+} quiesce_info;
+
+/* Binary image of the device made by EXPORT_IMAGE and loaded by IMPORT_IMAGE: an image_header followed by one
+ * image_minor for each minor with data or settings. Each image_minor is followed, for the low and then the high flow,
+ * by the lengths of the records (unsigned int each) and by their data. EXPORT_IMAGE fails with EBUSY while a spill
+ * file holds data
+ * */
+#define IMAGE_MAGIC 0x4d534931  // "MSI1"
+#define IMAGE_VERSION 1
+
+typedef struct _image_header{
+    __u32 magic;
+    __u32 version;
+    __u32 minors;       // number of image_minor entries
+    __u32 reserved;
+} image_header;
+
+/* Fixed width fields and explicit padding, so that the layout is the same on 32 and 64 bit kernels */
+typedef struct _image_minor{
+    __u32 minor;
+    __u32 disabled;     // value of SET_OPENCLOSE
+    __u32 overwrite;
+    __u32 records[2];   // number of records of each flow (0: low, 1: high)
+    __u32 bytes[2];     // bytes of data of each flow
+    __u32 reserved;
+    __u64 ttl_msecs[2];
+    __u64 age_msecs;
+} image_minor;
+
+/* Parameter of the EXPORT_IMAGE and IMPORT_IMAGE commands */
+typedef struct _image_info{
+    void *buffer;           // user buffer holding the image
+    unsigned long len;      // size of the buffer
+    unsigned long used;     // out: size of the image (export, also when the buffer is too small), bytes restored (import)
+} image_info;
+
+
+typedef struct _spill_info{
+    char path[SPILL_PATH_LEN];  // file that takes the data not fitting the flow, created or truncated; empty disables
+    unsigned long max_bytes;    // max amount of data kept in the file, 0 means no limit
+} spill_info;
 
 
 typedef struct _dev_info{